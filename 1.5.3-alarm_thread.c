@@ -6,6 +6,26 @@ typedef struct alarm_tag {
     char message[64];
 } alarm_t;
 
+/*
+ * Admission control. Every pending alarm here is a thread (with its
+ * own stack), so the limit is on the number of alarm threads (-n, 0
+ * for no limit). When it is reached, the policy (-p) is either to
+ * block until an alarm thread finishes, or to reject the new alarm.
+ * (There is no shed policy, since a sleeping alarm thread cannot be
+ * cheaply told apart from the others and dropped.)
+ */
+pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+int thread_count = 0;
+int max_threads = 0;
+int block_when_full = 1;
+
+/*
+ * Admission control counters, protected by thread_mutex.
+ */
+unsigned long admit_blocked = 0;
+unsigned long admit_rejected = 0;
+
 void *alarm_thread(void *arg) {
     alarm_t *alarm = (alarm_t*) arg;
     int status;
@@ -23,19 +43,96 @@ void *alarm_thread(void *arg) {
 
     free(alarm);
 
+    status = pthread_mutex_lock(&thread_mutex);
+    if (status != 0)
+        err_abort(status, "Lock thread mutex");
+    thread_count--;
+    status = pthread_cond_signal(&thread_cond);
+    if (status != 0)
+        err_abort(status, "Signal thread condition");
+    status = pthread_mutex_unlock(&thread_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock thread mutex");
+
     return NULL;
 }
 
+/*
+ * Reserve a slot for a new alarm thread. Returns 0 if the thread may
+ * be created, or EAGAIN if the alarm is rejected.
+ */
+int thread_admit(void) {
+    int status;
+    int result = 0;
+
+    status = pthread_mutex_lock(&thread_mutex);
+    if (status != 0)
+        err_abort(status, "Lock thread mutex");
+
+    if (max_threads > 0 && thread_count >= max_threads) {
+        if (block_when_full) {
+            admit_blocked++;
+            while (thread_count >= max_threads) {
+                status = pthread_cond_wait(&thread_cond, &thread_mutex);
+                if (status != 0)
+                    err_abort(status, "Wait on thread condition");
+            }
+        } else {
+            admit_rejected++;
+            result = EAGAIN;
+        }
+    }
+
+    if (result == 0)
+        thread_count++;
+
+    status = pthread_mutex_unlock(&thread_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock thread mutex");
+
+    return result;
+}
+
 int main(int argc, char *argv[]) {
     int status;
     char line[128];
     alarm_t *alarm;
     pthread_t thread;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            max_threads = atoi(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "block") == 0)
+                block_when_full = 1;
+            else if (strcmp(optarg, "reject") == 0)
+                block_when_full = 0;
+            else
+                goto usage;
+            break;
+        default:
+        usage:
+            fprintf(stderr,
+                    "Usage: %s [-n max-threads] [-p block|reject]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
 
     while (1) {
         printf("Alarm > ");
-        if (fgets(line, sizeof(line), stdin) == NULL)
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            if (max_threads > 0) {
+                pthread_mutex_lock(&thread_mutex);
+                printf("Admission control: %lu blocked, %lu rejected\n",
+                       admit_blocked, admit_rejected);
+                pthread_mutex_unlock(&thread_mutex);
+            }
             exit(0);
+        }
 
         if (strlen(line) <= 1)
             continue;
@@ -53,6 +150,9 @@ int main(int argc, char *argv[]) {
                    ) < 2) {
             fprintf(stderr, "Bad command\n");
             free(alarm);
+        } else if ((status = thread_admit()) != 0) {
+            fprintf(stderr, "Alarm refused: %s\n", strerror(status));
+            free(alarm);
         } else {
             status = pthread_create(
                                     &thread,
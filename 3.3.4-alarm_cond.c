@@ -1,335 +1,2335 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <time.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "errors.h"
+#include "alarm_ring.h"
+#include "skiplist.h"
 
 /**
  * Alarm data type.
+ *
+ * Only what is needed to order and fire an alarm is kept here, so
+ * that scanning the pending alarms touches as little memory as
+ * possible. The message text (and where the alarm came from) lives
+ * in message_arena, and message is its offset into the arena. time is
+ * the expiry time, in nanoseconds on CLOCK_MONOTONIC.
  */
 typedef struct {
-    int    seconds;
-    time_t time;
-    char   message[64];
+    int64_t  time;
+    int      seconds;
+    uint32_t message;
 } alarm_t;
 
 /**
- * Data type for Node of alarm linked list.
+ * Where an alarm came from, and so how to report it when it fires.
+ */
+typedef enum {
+    ALARM_SOURCE_STDIN,  // Print it.
+    ALARM_SOURCE_RING,   // Post it to a shared-memory completion ring.
+    ALARM_SOURCE_SOCKET  // Send it back on a Unix domain socket.
+} alarm_source_t;
+
+/**
+ * Who to report an alarm to.
+ */
+typedef struct {
+    uint16_t source;     // An alarm_source_t.
+    uint16_t generation; // Of the connection, for ALARM_SOURCE_SOCKET.
+    uint32_t owner;      // Completion ring, or connection.
+    uint64_t tag;        // Owner's identifier for the alarm.
+} alarm_origin_t;
+
+/**
+ * Record in message_arena for one alarm: its origin, followed by its
+ * (variable-length, NUL-terminated) message. Records are padded to a
+ * multiple of 8 bytes, so that the next one is aligned.
+ */
+typedef struct {
+    alarm_origin_t origin;
+    uint32_t       length;  // Of message, not counting the NUL.
+    char           message[];
+} alarm_payload_t;
+
+#define PAYLOAD_SIZE(length) \
+    ((sizeof(alarm_payload_t) + (length) + 1 + 7) & ~(size_t) 7)
+
+/**
+ * Arena that holds the payloads of the pending alarms.
+ *
+ * Messages are allocated by bumping used. Freeing a message only
+ * lowers live; the space is reclaimed either when the arena becomes
+ * empty, or by compacting the arena when it is mostly garbage.
+ */
+typedef struct {
+    char   *base;
+    size_t  used;     // Bytes handed out so far.
+    size_t  capacity; // Bytes allocated for base.
+    size_t  live;     // Bytes still referenced by pending alarms.
+} message_arena_t;
+
+/**
+ * Mutex that protects alarms and message_arena. With the skip list
+ * engine, it instead serializes removals from alarm_skiplist.
+ *
+ * With -P, main re-initializes it to use priority inheritance, so
+ * that a low-priority producer holding it runs at the priority of the
+ * alarm-handling thread while that thread waits for it (see
+ * inversion-test.c).
+ */
+pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Condition variable that that signals changes to alarms. It is
+ * initialized in main, so that its timed waits use CLOCK_MONOTONIC
+ * like the alarm expiry times.
+ */
+pthread_cond_t alarm_cond;
+
+/**
+ * Condition variable that signals that alarms have fired, so that
+ * there may be room for a producer blocked by admission control.
+ */
+pthread_cond_t alarm_space_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Array that holds the pending alarms, sorted by ascending expiry
+ * time, in alarms[alarm_head] to alarms[alarm_head + alarm_count - 1].
+ * The next alarm to expire is removed by moving alarm_head up, and a
+ * new alarm that expires after every pending one (the usual case when
+ * alarms share a timeout) is appended, so neither moves anything.
+ * Alarms that belong in the middle move whichever side is shorter.
+ */
+alarm_t *alarms = NULL;
+size_t alarm_head = 0;
+size_t alarm_count = 0;
+size_t alarm_capacity = 0;
+
+/**
+ * Arena that holds the messages of the alarms in alarms.
+ */
+message_arena_t message_arena = { NULL, 0, 0, 0 };
+
+/**
+ * Storage engine for the pending alarms (-e):
+ *
+ *   array:    alarms and message_arena, protected by alarm_mutex
+ *   skiplist: alarm_skiplist (see skiplist.h), which producers insert
+ *             into, and scan, without taking alarm_mutex. Each node
+ *             holds the alarm's alarm_payload_t, and its seconds as
+ *             the node's value.
+ */
+typedef enum {
+    ENGINE_ARRAY,
+    ENGINE_SKIPLIST
+} engine_t;
+
+engine_t engine = ENGINE_ARRAY;
+skiplist_t alarm_skiplist;
+
+/**
+ * current_alarm is 0 if the thread that handles alarms is idle. If
+ * the alarm-handling thread is not idle, then current_alarm will have
+ * the expiration (timestamp) value of the alarm being handled.
+ *
+ * It is atomic because, in the low-latency mode, the alarm-handling
+ * thread polls it without holding the mutex (see spin_window).
+ */
+_Atomic int64_t current_alarm = 0;
+
+/**
+ * Timer slack (in nanoseconds). An alarm may fire up to this long
+ * after its expiry time, which lets the alarm-handling thread fire
+ * every alarm that expires within the slack window in a single
+ * wakeup, rather than waking up once for each distinct expiry time.
+ * Set with -s on the command line (in seconds, which may be
+ * fractional). The default of 0 keeps alarms precise.
+ */
+int64_t slack = 0;
+
+/**
+ * Number of wakeups saved by coalescing: each alarm that was fired in
+ * the same wakeup as an alarm with an earlier expiry time would
+ * otherwise have needed its own timed wait. Protected by alarm_mutex.
+ */
+unsigned long wakeups_saved = 0;
+
+/**
+ * Spin window (in nanoseconds) for the low-latency mode. A timed wait
+ * typically wakes up tens to hundreds of microseconds late, so when
+ * this is nonzero, the alarm-handling thread only blocks until this
+ * long before the alarm is due, then busy-polls the clock for the
+ * rest. Set with -S on the command line (in microseconds). The
+ * default of 0 disables spinning.
+ */
+int64_t spin_window = 0;
+
+/**
+ * CPU to pin the alarm-handling thread to (-c), or -1 to not pin it.
+ */
+int alarm_cpu = -1;
+
+/**
+ * SCHED_FIFO priority for the alarm-handling thread (-r), or 0 to
+ * leave it in the default scheduling class.
+ */
+int alarm_priority = 0;
+
+/**
+ * What to do with a new alarm when admitting it would go over
+ * max_alarms or max_memory:
+ *
+ *   block:  wait until enough pending alarms have fired (except for
+ *           socket clients, which share the one epoll thread and so
+ *           are refused instead)
+ *   reject: refuse the new alarm
+ *   shed:   drop pending alarms with the latest expiry times to make
+ *           room (or refuse the new alarm, if it would expire last)
+ */
+typedef enum {
+    ADMIT_BLOCK,
+    ADMIT_REJECT,
+    ADMIT_SHED
+} admission_policy_t;
+
+/**
+ * Admission control limits (0 means no limit): the number of pending
+ * alarms (-n), and the bytes they take up in alarms and message_arena
+ * (-m). Set the policy with -p.
+ */
+size_t max_alarms = 0;
+size_t max_memory = 0;
+admission_policy_t admission_policy = ADMIT_BLOCK;
+
+/**
+ * Shared-memory ring that other processes submit alarms through
+ * (see alarm_ring.h), created with -R, or NULL.
+ */
+alarm_ring_t *ring = NULL;
+
+/**
+ * Maximum number of ring submissions handled per lock of alarm_mutex.
+ */
+#define RING_BATCH 64
+
+/**
+ * A client connected to the Unix domain socket (created with -U).
+ *
+ * Only the socket thread touches input. output (replies and expiry
+ * notifications not yet sent) is also appended to by the
+ * alarm-handling thread, so it is protected by socket_mutex, as is
+ * everything else here apart from input.
+ */
+typedef struct {
+    int      fd;          // -1 if this slot is free.
+    uint16_t generation;  // Bumped on close, so late alarms are dropped.
+    int      dirty;       // Whether it is on dirty_connections.
+    int      writing;     // Whether epoll is watching for EPOLLOUT.
+    int      overflowed;  // Whether output went over SOCKET_OUTPUT_LIMIT.
+    char    *input;
+    size_t   input_length;
+    size_t   input_capacity;
+    char    *output;
+    size_t   output_length;
+    size_t   output_capacity;
+} connection_t;
+
+/**
+ * Socket frontend state. The socket thread waits in epoll_wait on the
+ * listening socket, the connections, and wake_fd, an eventfd through
+ * which the alarm-handling thread asks for the output of the
+ * connections on dirty_connections to be sent.
+ */
+pthread_mutex_t socket_mutex = PTHREAD_MUTEX_INITIALIZER;
+int listen_fd = -1;
+int epoll_fd = -1;
+int wake_fd = -1;
+int wake_pending = 0;
+connection_t *connections = NULL;
+uint32_t *dirty_connections = NULL;
+size_t dirty_count = 0;
+size_t connection_capacity = 0;
+
+/**
+ * Most bytes read from one connection before moving on to the others,
+ * and the longest request line accepted.
+ */
+#define SOCKET_READ_LIMIT 65536
+#define SOCKET_LINE_LIMIT 65536
+
+/**
+ * Most bytes of replies and notifications held for a connection that
+ * is not reading them. Past that, the connection is closed.
+ */
+#define SOCKET_OUTPUT_LIMIT (1024 * 1024)
+
+/**
+ * epoll data for the listening socket and wake_fd (connections use
+ * their index).
+ */
+#define EPOLL_LISTEN (~(uint64_t) 0)
+#define EPOLL_WAKE   (~(uint64_t) 1)
+
+/**
+ * Admission control counters, protected by alarm_mutex: how many
+ * times a producer blocked, how many new alarms were rejected, and
+ * how many pending alarms were shed.
+ */
+unsigned long admit_blocked = 0;
+unsigned long admit_rejected = 0;
+unsigned long admit_shed = 0;
+
+/**
+ * Fire latency statistics: how long after its expiry time each alarm
+ * was actually fired. latency_histogram[i] counts alarms that fired
+ * less than 2^i (and at least 2^(i-1)) nanoseconds late. Protected by
+ * alarm_mutex.
+ */
+#define LATENCY_BUCKETS 64
+unsigned long latency_histogram[LATENCY_BUCKETS];
+unsigned long fired_count = 0;
+int64_t latency_total = 0;
+int64_t latency_max = 0;
+
+/**
+ * Virtual clock (-V). Instead of reading alarms from stdin as they are
+ * typed, main replays a schedule ("<offset-ms> <seconds> <message>"
+ * lines, as in the trace files of load-generator.c) against a clock
+ * that only moves when main moves it:
+ *
+ *   - the alarm-handling thread waits with clock_wait, which, rather
+ *     than blocking until a real time, tells main when it wants to be
+ *     woken (virtual_deadline, 0 for never) and that it is waiting,
+ *
+ *   - main, before scheduling each alarm, waits for the alarm-handling
+ *     thread to be waiting, and while the deadline it asked for comes
+ *     before the alarm's offset, sets virtual_now to that deadline and
+ *     wakes it.
+ *
+ * Time thus jumps straight from one event to the next, so a schedule
+ * spanning hours replays as fast as the scheduler can handle it, and
+ * the order in which alarms fire does not depend on how the threads
+ * happen to be scheduled. Protected by alarm_mutex (virtual_now is
+ * atomic so that now_ns can read it without the mutex).
+ */
+int virtual_clock = 0;
+_Atomic int64_t virtual_now = 1000000000;
+int64_t virtual_deadline = 0;
+int virtual_waiting = 0;
+pthread_cond_t virtual_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Read CLOCK_MONOTONIC in nanoseconds.
+ */
+int64_t real_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Read the clock that alarms are timed by, in nanoseconds: the
+ * virtual clock with -V, otherwise CLOCK_MONOTONIC. (The virtual clock
+ * starts at one second, since an expiry time of 0 would look like an
+ * idle alarm-handling thread in current_alarm.)
+ */
+int64_t now_ns(void) {
+    if (virtual_clock)
+        return virtual_now;
+    return real_ns();
+}
+
+/**
+ * Record the fire latency of one alarm.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void record_latency(int64_t latency) {
+    int bucket = 0;
+
+    if (latency < 0)
+        latency = 0;
+    if (latency > 0)
+        bucket = 64 - __builtin_clzll(latency);
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+
+    latency_histogram[bucket]++;
+    fired_count++;
+    latency_total += latency;
+    if (latency > latency_max)
+        latency_max = latency;
+}
+
+/**
+ * Return an upper bound (in nanoseconds) on the given fraction of
+ * fire latencies, from the histogram. That is the top of a bucket,
+ * unless the largest latency seen is lower.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+int64_t latency_percentile(double fraction) {
+    unsigned long seen = 0;
+    int64_t bound;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency_histogram[i];
+        if (seen >= fraction * fired_count)
+            break;
+    }
+    bound = i == 0 ? 0 : (int64_t) 1 << i;
+    return bound < latency_max ? bound : latency_max;
+}
+
+/**
+ * Get the payload of an alarm. The pointer is only valid until the
+ * arena is next allocated from (which may move it), so the alarm
+ * mutex must be held while using it.
+ */
+alarm_payload_t *alarm_payload(const alarm_t *alarm) {
+    return (alarm_payload_t*) (message_arena.base + alarm->message);
+}
+
+/**
+ * Get the message of an alarm (with the same caveat as
+ * alarm_payload).
+ */
+char *alarm_message(const alarm_t *alarm) {
+    return alarm_payload(alarm)->message;
+}
+
+/**
+ * Copy every live payload into a fresh buffer, dropping the space of
+ * freed payloads, and update the pending alarms to point at the new
+ * copies.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void arena_compact(size_t capacity) {
+    char *base;
+    size_t used = 0;
+    size_t size;
+    size_t i;
+
+    base = malloc(capacity);
+    if (base == NULL)
+        errno_abort("Allocate message arena");
+
+    for (i = alarm_head; i < alarm_head + alarm_count; i++) {
+        size = PAYLOAD_SIZE(alarm_payload(&alarms[i])->length);
+        memcpy(base + used, alarm_payload(&alarms[i]), size);
+        alarms[i].message = used;
+        used += size;
+    }
+
+    free(message_arena.base);
+    message_arena.base = base;
+    message_arena.used = used;
+    message_arena.capacity = capacity;
+}
+
+/**
+ * Copy a message of the given length (not counting the NUL) into the
+ * arena, along with where it came from, and return its offset.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+uint32_t arena_alloc(const alarm_origin_t *origin,
+                     const char *message, size_t length) {
+    size_t needed = PAYLOAD_SIZE(length);
+    size_t capacity;
+    alarm_payload_t *payload;
+    uint32_t offset;
+
+    if (message_arena.used + needed > message_arena.capacity) {
+        /*
+         * Grow to (at least) twice what is live, so that after
+         * compacting at least half the arena is free again.
+         */
+        capacity = message_arena.capacity ? message_arena.capacity : 4096;
+        while (capacity < 2 * (message_arena.live + needed))
+            capacity *= 2;
+        if (capacity > UINT32_MAX)
+            err_abort(ENOMEM, "Grow message arena");
+
+        /*
+         * If at least half of what has been handed out is garbage,
+         * compacting is worth it. Otherwise just grow in place, which
+         * keeps all of the offsets valid.
+         */
+        if (message_arena.used - message_arena.live
+            >= message_arena.used / 2) {
+            arena_compact(capacity);
+        } else {
+            message_arena.base = realloc(message_arena.base, capacity);
+            if (message_arena.base == NULL)
+                errno_abort("Grow message arena");
+            message_arena.capacity = capacity;
+        }
+    }
+
+    offset = message_arena.used;
+    payload = (alarm_payload_t*) (message_arena.base + offset);
+    payload->origin = *origin;
+    payload->length = length;
+    memcpy(payload->message, message, length);
+    payload->message[length] = '\0';
+    message_arena.used += needed;
+    message_arena.live += needed;
+
+    return offset;
+}
+
+/**
+ * Release the payload of an alarm that is being removed.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void arena_free(const alarm_t *alarm) {
+    message_arena.live -= PAYLOAD_SIZE(alarm_payload(alarm)->length);
+
+    // Nothing is referenced any more, so start again from the front.
+    if (message_arena.live == 0)
+        message_arena.used = 0;
+}
+
+void socket_notify(const alarm_origin_t *origin, int status);
+
+/**
+ * Report an alarm to wherever it came from: status is 0 if it has
+ * fired, or ECANCELED if it was shed by admission control.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void alarm_notify(int seconds, const alarm_payload_t *payload, int status) {
+    alarm_ring_completion_t done;
+
+    switch (payload->origin.source) {
+    case ALARM_SOURCE_STDIN:
+        if (status == 0)
+            printf("(%d) %s\n", seconds, payload->message);
+        else
+            fprintf(stderr, "Shed (%d) %s\n",
+                    seconds, payload->message);
+        break;
+
+    case ALARM_SOURCE_RING:
+        done.tag = payload->origin.tag;
+        done.status = status;
+        done.seconds = seconds;
+        done.fired = now_ns();
+        done.generation = payload->origin.generation;
+        alarm_ring_complete(ring, payload->origin.owner, &done);
+        break;
+
+    case ALARM_SOURCE_SOCKET:
+        socket_notify(&payload->origin, status);
+        break;
+    }
+}
+
+/**
+ * Number of pending alarms, and the bytes they take up.
+ */
+size_t alarm_pending(void) {
+    if (engine == ENGINE_SKIPLIST)
+        return atomic_load(&alarm_skiplist.count);
+    return alarm_count;
+}
+
+size_t alarm_memory(void) {
+    if (engine == ENGINE_SKIPLIST)
+        return atomic_load(&alarm_skiplist.bytes);
+    return alarm_count * sizeof(alarm_t) + message_arena.live;
+}
+
+/**
+ * Whether adding an alarm that takes up the given number of bytes
+ * would go over the admission control limits.
+ *
+ * With the array engine, THE ALARM LIST MUTEX MUST BE LOCKED BY THE
+ * CALLER OF THIS METHOD. The skip list keeps its totals in atomics, so
+ * they can be checked without it (at the cost of concurrent producers
+ * being able to overshoot the limits slightly).
+ */
+int alarm_over_limit(size_t needed) {
+    if (max_alarms > 0 && alarm_pending() + 1 > max_alarms)
+        return 1;
+    if (max_memory > 0 && alarm_memory() + needed > max_memory)
+        return 1;
+    return 0;
+}
+
+/**
+ * Remove the alarm at the given index of the array, moving whichever
+ * side of it is shorter to close the gap (so removing the first or
+ * last alarm moves nothing). Its message must already have been freed.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void alarm_remove(size_t index) {
+    size_t end = alarm_head + alarm_count;
+
+    if (index - alarm_head < end - 1 - index) {
+        memmove(&alarms[alarm_head + 1],
+                &alarms[alarm_head],
+                (index - alarm_head) * sizeof(alarm_t));
+        alarm_head++;
+    } else {
+        memmove(&alarms[index],
+                &alarms[index + 1],
+                (end - 1 - index) * sizeof(alarm_t));
+    }
+    alarm_count--;
+    if (alarm_count == 0)
+        alarm_head = 0;
+}
+
+/**
+ * Remove the pending alarm with the latest expiry time, reporting it
+ * as shed, if it expires after the given time. Returns 0, or ENOENT if
+ * there is no such alarm.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+int alarm_shed_latest(int64_t time) {
+    skiplist_node_t *node;
+    alarm_t *alarm;
+
+    if (engine == ENGINE_SKIPLIST) {
+        node = skiplist_last(&alarm_skiplist);
+        if (node == NULL || node->key <= time)
+            return ENOENT;
+        alarm_notify(node->value, skiplist_data(node), ECANCELED);
+        skiplist_remove(&alarm_skiplist, node);
+        return 0;
+    }
+
+    // The latest pending alarm is the last in the array.
+    if (alarm_count == 0)
+        return ENOENT;
+    alarm = &alarms[alarm_head + alarm_count - 1];
+    if (alarm->time <= time)
+        return ENOENT;
+    alarm_notify(alarm->seconds, alarm_payload(alarm), ECANCELED);
+    arena_free(alarm);
+    alarm_remove(alarm_head + alarm_count - 1);
+    return 0;
+}
+
+/**
+ * Make room for a new alarm with the given expiry time and origin,
+ * that takes up the given number of bytes, according to
+ * admission_policy. Returns 0 if the alarm may be inserted, or EAGAIN
+ * if it was refused.
+ *
+ * Since this may wait on alarm_space_cond (and may remove pending
+ * alarms), THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS
+ * METHOD.
+ */
+int alarm_make_room(int64_t time, const alarm_origin_t *origin,
+                    size_t needed) {
+    int blocked = 0;
+
+    /*
+     * An alarm that could never fit would block forever (or shed
+     * everything and still not fit), so always refuse it.
+     */
+    if (max_memory > 0 && needed > max_memory) {
+        admit_rejected++;
+        return EAGAIN;
+    }
+
+    while (alarm_over_limit(needed)) {
+        switch (admission_policy) {
+        case ADMIT_BLOCK:
+            /*
+             * Waiting here would stall socket_thread, and with it
+             * every other connection (including the ones whose
+             * cancels would make room), so refuse the alarm instead.
+             */
+            if (origin->source == ALARM_SOURCE_SOCKET) {
+                admit_rejected++;
+                return EAGAIN;
+            }
+            if (!blocked) {
+                admit_blocked++;
+                blocked = 1;
+            }
+            pthread_cond_wait(&alarm_space_cond, &alarm_mutex);
+            break;
+
+        case ADMIT_REJECT:
+            admit_rejected++;
+            return EAGAIN;
+
+        case ADMIT_SHED:
+            /*
+             * If the new alarm would expire after every pending one,
+             * the new alarm is the one to shed (which counts as
+             * rejecting it, since it was never pending).
+             */
+            if (alarm_shed_latest(time) != 0) {
+                admit_rejected++;
+                return EAGAIN;
+            }
+            admit_shed++;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Admit a new alarm with the given expiry time, origin and message
+ * length (see alarm_make_room).
+ *
+ * With the array engine, THE ALARM LIST MUTEX MUST BE LOCKED BY THE
+ * CALLER OF THIS METHOD. With the skip list, alarm_mutex is only taken
+ * if the alarm is over a limit.
+ */
+int alarm_admit(int64_t time, const alarm_origin_t *origin,
+                size_t length) {
+    size_t needed = sizeof(alarm_t) + PAYLOAD_SIZE(length);
+    int status;
+
+    if (engine == ENGINE_ARRAY)
+        return alarm_make_room(time, origin, needed);
+
+    if (!alarm_over_limit(needed))
+        return 0;
+    pthread_mutex_lock(&alarm_mutex);
+    status = alarm_make_room(time, origin, needed);
+    pthread_mutex_unlock(&alarm_mutex);
+    return status;
+}
+
+/**
+ * Print the list of alarms for debugging. This will only print if the
+ * the -DDEBUG flag is enabled when compiling.
+ */
+void print_list() {
+#ifdef DEBUG /* Only define if -DDEBUG flag enabled. */
+
+    // Iterate through alarms from the earliest, printing each one
+    size_t i;
+    printf("{");
+    for (i = alarm_head; i < alarm_head + alarm_count; i++) {
+        printf("%lld (%lld ms) [\"%s\"]",
+               (long long) alarms[i].time,
+               (long long) (alarms[i].time - now_ns()) / 1000000,
+               alarm_message(&alarms[i]));
+        // Put comma, unless it is the last item in the list
+        if (i + 1 < alarm_head + alarm_count) {
+            printf(", ");
+        }
+    }
+    printf("} %zu bytes of alarms, %zu/%zu bytes of messages\n",
+           alarm_count * sizeof(alarm_t),
+           message_arena.live,
+           message_arena.used);
+
+#endif
+}
+
+/**
+ * Notify the alarm-handling thread if an alarm with the given expiry
+ * time has to be handled before what it is waiting for.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void alarm_wake(int64_t time) {
+    /*
+     * If current_alarm is 0, then the other thread is idle. If
+     * current_alarm is greater than the new alarm, then the other
+     * thread is handling an alarm that happens after the new alarm.
+     * In both cases, we should set current_alarm to the new alarm, so
+     * that it gets handled now and, notify the other thread about
+     * this.
+     */
+    if (current_alarm == 0 || time < current_alarm) {
+        current_alarm = time;
+        pthread_cond_signal(&alarm_cond);
+
+        // With -V, the driver must now wait for it to wait again.
+        virtual_waiting = 0;
+    }
+}
+
+/**
+ * Insert an alarm into the alarm array and possibly notify other
+ * thread that an alarm has been inserted.
+ *
+ * Special considerations:
+ *   - since this function updates the alarm array, THE ALARM LIST
+ *     MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ *
+ *   - the alarm is copied into the array, and its message must
+ *     already be in the message arena.
+ */
+void alarm_insert(const alarm_t *alarm) {
+    size_t low, high, middle;
+    size_t end;
+
+    /*
+     * Make room after the last alarm: slide the alarms down to the
+     * start of the array if more than half of it is free space left
+     * by fired alarms (which pays for the copy), or grow it.
+     */
+    if (alarm_head + alarm_count == alarm_capacity) {
+        if (alarm_head > alarm_count) {
+            memmove(&alarms[0],
+                    &alarms[alarm_head],
+                    alarm_count * sizeof(alarm_t));
+            alarm_head = 0;
+        } else {
+            alarm_capacity = alarm_capacity ? alarm_capacity * 2 : 64;
+            alarms = realloc(alarms, alarm_capacity * sizeof(alarm_t));
+            if (alarms == NULL)
+                errno_abort("Grow alarm array");
+        }
+    }
+
+    /*
+     * Binary search for the first alarm that expires strictly after
+     * the new one. The new alarm goes right before it, which puts it
+     * after (so it fires after) any alarms with the same expiry time.
+     * Checking the last alarm first makes the common case of a new
+     * latest alarm constant time.
+     */
+    end = alarm_head + alarm_count;
+    if (alarm_count == 0 || alarms[end - 1].time <= alarm->time) {
+        low = end;
+    } else {
+        low = alarm_head;
+        high = end - 1;
+        while (low < high) {
+            middle = low + (high - low) / 2;
+            if (alarms[middle].time <= alarm->time)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+    }
+
+    if (alarm_head > 0 && low - alarm_head < end - low) {
+        memmove(&alarms[alarm_head - 1],
+                &alarms[alarm_head],
+                (low - alarm_head) * sizeof(alarm_t));
+        alarm_head--;
+        alarms[low - 1] = *alarm;
+    } else {
+        memmove(&alarms[low + 1],
+                &alarms[low],
+                (end - low) * sizeof(alarm_t));
+        alarms[low] = *alarm;
+    }
+    alarm_count++;
+
+    // Print list. This will only happen if debug flag is enabled.
+    print_list();
+
+    alarm_wake(alarm->time);
+}
+
+/**
+ * Insert an alarm into the skip list. alarm_mutex is only taken if
+ * the alarm-handling thread has to be woken for it.
+ */
+void alarm_insert_skiplist(int64_t time, int seconds,
+                           const alarm_origin_t *origin,
+                           const char *message, size_t length) {
+    skiplist_node_t *node;
+    alarm_payload_t *payload;
+
+    node = skiplist_node_new(time, seconds, PAYLOAD_SIZE(length));
+    payload = skiplist_data(node);
+    payload->origin = *origin;
+    payload->length = length;
+    memcpy(payload->message, message, length);
+    payload->message[length] = '\0';
+
+    skiplist_insert(&alarm_skiplist, node);
+
+    /*
+     * Reading current_alarm after the insert pairs with the
+     * alarm-handling thread resetting current_alarm before it looks
+     * at the skip list: either it sees this alarm, or we see that it
+     * needs waking (and then recheck under the mutex).
+     */
+    if (current_alarm == 0 || time < current_alarm) {
+        pthread_mutex_lock(&alarm_mutex);
+        alarm_wake(time);
+        pthread_mutex_unlock(&alarm_mutex);
+    }
+}
+
+/**
+ * Lock what a producer needs locked to call alarm_schedule,
+ * alarm_cancel, or alarm_range: alarm_mutex with the array engine,
+ * and nothing with the skip list (those functions take alarm_mutex
+ * themselves when they need it).
+ */
+void schedule_lock(void) {
+    if (engine == ENGINE_ARRAY)
+        pthread_mutex_lock(&alarm_mutex);
+}
+
+void schedule_unlock(void) {
+    if (engine == ENGINE_ARRAY)
+        pthread_mutex_unlock(&alarm_mutex);
+}
+
+/**
+ * Schedule an alarm for the given number of seconds from now, if
+ * admission control lets it in. Returns 0, or the status from
+ * alarm_admit.
+ *
+ * THE CALLER MUST HOLD schedule_lock.
+ */
+int alarm_schedule(int seconds, const alarm_origin_t *origin,
+                   const char *message, size_t length) {
+    alarm_t alarm;
+    int status;
+
+    // Calculate absolute expiry time for the alarm.
+    alarm.seconds = seconds;
+    alarm.time = now_ns() + (int64_t) seconds * 1000000000;
+
+    // Make sure there is room for the alarm.
+    status = alarm_admit(alarm.time, origin, length);
+    if (status != 0)
+        return status;
+
+    if (engine == ENGINE_SKIPLIST) {
+        alarm_insert_skiplist(alarm.time, seconds, origin, message, length);
+        return 0;
+    }
+
+    // Copy the message into the arena.
+    alarm.message = arena_alloc(origin, message, length);
+
+    // Insert the alarm into the array.
+    alarm_insert(&alarm);
+
+    return 0;
+}
+
+/**
+ * Whether a pending alarm has the given origin.
+ */
+int alarm_origin_equal(const alarm_origin_t *one, const alarm_origin_t *other) {
+    return one->tag == other->tag
+        && one->owner == other->owner
+        && one->source == other->source
+        && one->generation == other->generation;
+}
+
+/**
+ * Call visit for every pending alarm that expires between from and to
+ * (inclusive), earliest first, until it returns nonzero.
+ *
+ * THE CALLER MUST HOLD schedule_lock. With the skip list, that means
+ * the scan takes no lock at all, and runs alongside inserts and
+ * the alarm-handling thread.
+ */
+typedef int (*alarm_visit_t)(int64_t time, int seconds,
+                             const alarm_payload_t *payload, void *arg);
+
+typedef struct {
+    alarm_visit_t visit;
+    void         *arg;
+} range_visit_t;
+
+int alarm_range_node(skiplist_node_t *node, void *arg) {
+    range_visit_t *range = arg;
+
+    return range->visit(node->key, node->value, skiplist_data(node),
+                        range->arg);
+}
+
+void alarm_range(int64_t from, int64_t to, alarm_visit_t visit, void *arg) {
+    range_visit_t range = { visit, arg };
+    size_t i;
+
+    if (engine == ENGINE_SKIPLIST) {
+        skiplist_range(&alarm_skiplist, from, to, alarm_range_node, &range);
+        return;
+    }
+
+    for (i = alarm_head;
+         i < alarm_head + alarm_count && alarms[i].time <= to;
+         i++) {
+        if (alarms[i].time >= from
+            && visit(alarms[i].time, alarms[i].seconds,
+                     alarm_payload(&alarms[i]), arg))
+            break;
+    }
+}
+
+/**
+ * Whether a pending alarm with the given origin is one that
+ * alarm_remove_matching should remove: one with exactly the origin
+ * asked for, or (with all) any alarm of the same owner.
+ */
+int alarm_cancel_matches(const alarm_origin_t *candidate,
+                         const alarm_origin_t *origin, int all) {
+    if (!all)
+        return alarm_origin_equal(candidate, origin);
+    return candidate->owner == origin->owner
+        && candidate->source == origin->source
+        && candidate->generation == origin->generation;
+}
+
+/**
+ * A skip list node that alarm_remove_matching has found, by its key and
+ * insertion sequence (which never change, and are unique), so that it
+ * can be found again without trusting a pointer to it.
+ */
+typedef struct {
+    int64_t  key;
+    uint64_t sequence;
+} cancel_node_t;
+
+/**
+ * Skip list visitor for alarm_remove_matching: collect the matching
+ * nodes, stopping at the first unless all is set.
+ */
+typedef struct {
+    const alarm_origin_t *origin;
+    int                   all;
+    cancel_node_t        *nodes;
+    size_t                count;
+    size_t                capacity;
+} cancel_search_t;
+
+int alarm_cancel_node(skiplist_node_t *node, void *arg) {
+    cancel_search_t *search = arg;
+    alarm_payload_t *payload = skiplist_data(node);
+
+    if (!alarm_cancel_matches(&payload->origin, search->origin, search->all))
+        return 0;
+    if (search->count == search->capacity) {
+        search->capacity = search->capacity ? search->capacity * 2 : 16;
+        search->nodes = realloc(search->nodes,
+                                search->capacity * sizeof(cancel_node_t));
+        if (search->nodes == NULL)
+            errno_abort("Grow cancel list");
+    }
+    search->nodes[search->count].key = node->key;
+    search->nodes[search->count].sequence = node->sequence;
+    search->count++;
+    return !search->all;
+}
+
+/**
+ * Skip list visitor for alarm_remove_matching: find the node with the
+ * given sequence again, if it is still in the list.
+ */
+typedef struct {
+    uint64_t         sequence;
+    skiplist_node_t *node;
+} cancel_refind_t;
+
+int alarm_refind_node(skiplist_node_t *node, void *arg) {
+    cancel_refind_t *refind = arg;
+
+    if (node->sequence != refind->sequence)
+        return 0;
+    refind->node = node;
+    return 1;
+}
+
+/**
+ * Remove (without reporting them) the pending alarm with the given
+ * origin or, with all, every pending alarm of the same owner. Returns
+ * how many were removed.
+ *
+ * If one was the alarm being waited for, the alarm-handling thread
+ * just wakes up to find nothing due, and looks again.
+ *
+ * THE CALLER MUST HOLD schedule_lock.
+ */
+size_t alarm_remove_matching(const alarm_origin_t *origin, int all) {
+    cancel_search_t search = { origin, all, NULL, 0, 0 };
+    cancel_refind_t refind;
+    size_t removed = 0;
+    size_t kept;
+    size_t i;
+
+    if (engine == ENGINE_SKIPLIST) {
+        /*
+         * Search the whole list without alarm_mutex, so as not to hold
+         * up the alarm-handling thread. Whatever was found may have
+         * fired (and been freed) since, so only take the mutex, which
+         * serializes removals, to look each one up again by its key
+         * and remove it if it is still there.
+         */
+        skiplist_range(&alarm_skiplist, INT64_MIN, INT64_MAX,
+                       alarm_cancel_node, &search);
+        if (search.count == 0)
+            return 0;
+        pthread_mutex_lock(&alarm_mutex);
+        for (i = 0; i < search.count; i++) {
+            refind.sequence = search.nodes[i].sequence;
+            refind.node = NULL;
+            skiplist_range(&alarm_skiplist,
+                           search.nodes[i].key, search.nodes[i].key,
+                           alarm_refind_node, &refind);
+            if (refind.node != NULL) {
+                skiplist_remove(&alarm_skiplist, refind.node);
+                removed++;
+            }
+        }
+        pthread_mutex_unlock(&alarm_mutex);
+        free(search.nodes);
+        return removed;
+    }
+
+    /*
+     * The array can only be searched holding alarm_mutex, since every
+     * insert moves alarms around in it (and holds the mutex to do so).
+     */
+    if (!all) {
+        for (i = alarm_head; i < alarm_head + alarm_count; i++) {
+            if (alarm_origin_equal(&alarm_payload(&alarms[i])->origin,
+                                   origin)) {
+                arena_free(&alarms[i]);
+                alarm_remove(i);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // Close up the gaps in a single pass.
+    kept = alarm_head;
+    for (i = alarm_head; i < alarm_head + alarm_count; i++) {
+        if (alarm_cancel_matches(&alarm_payload(&alarms[i])->origin,
+                                 origin, 1))
+            arena_free(&alarms[i]);
+        else
+            alarms[kept++] = alarms[i];
+    }
+    i = alarm_head + alarm_count - kept;
+    alarm_count = kept - alarm_head;
+    if (alarm_count == 0)
+        alarm_head = 0;
+    return i;
+}
+
+/**
+ * Remove the pending alarm with the given origin (without reporting
+ * it). Returns 0, or ENOENT if there is no such alarm.
+ *
+ * THE CALLER MUST HOLD schedule_lock.
+ */
+int alarm_cancel(const alarm_origin_t *origin) {
+    return alarm_remove_matching(origin, 0) > 0 ? 0 : ENOENT;
+}
+
+/**
+ * Remove (without reporting them) every pending alarm with the given
+ * origin's source, owner and generation, whatever their tags: those
+ * of an owner that has gone away.
+ *
+ * THE CALLER MUST HOLD schedule_lock.
+ */
+void alarm_cancel_owner(const alarm_origin_t *origin) {
+    alarm_remove_matching(origin, 1);
+}
+
+/**
+ * Get the expiry time of the next alarm to expire. Returns 0 if there
+ * are no pending alarms, otherwise 1.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ * (With the skip list, holding it is what makes it safe to look at the
+ * first node without entering the list, since only threads that hold
+ * it remove and free nodes.)
+ */
+int alarm_next(int64_t *time) {
+    skiplist_node_t *node;
+
+    if (engine == ENGINE_SKIPLIST) {
+        node = skiplist_first(&alarm_skiplist);
+        if (node == NULL)
+            return 0;
+        *time = node->key;
+        return 1;
+    }
+
+    if (alarm_count == 0)
+        return 0;
+    *time = alarms[alarm_head].time;
+    return 1;
+}
+
+/**
+ * Remove the next alarm to expire, and report it as fired.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void alarm_fire_next(void) {
+    skiplist_node_t *node;
+    alarm_t *alarm;
+
+    if (engine == ENGINE_SKIPLIST) {
+        node = skiplist_first(&alarm_skiplist);
+        alarm_notify(node->value, skiplist_data(node), 0);
+        skiplist_remove(&alarm_skiplist, node);
+        return;
+    }
+
+    alarm = &alarms[alarm_head];
+    alarm_notify(alarm->seconds, alarm_payload(alarm), 0);
+    arena_free(alarm);
+    alarm_remove(alarm_head);
+}
+
+/**
+ * Wait on alarm_cond until the given time (on the clock of now_ns), or
+ * for as long as it takes if deadline is 0. Returns ETIMEDOUT if the
+ * time has come, otherwise 0 (which, as for any condition wait, may
+ * be for no reason).
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+int clock_wait(int64_t deadline) {
+    struct timespec cond_time;
+
+    if (virtual_clock) {
+        // Tell the driver how far it may move the clock for us.
+        virtual_deadline = deadline;
+        virtual_waiting = 1;
+        pthread_cond_signal(&virtual_cond);
+        pthread_cond_wait(&alarm_cond, &alarm_mutex);
+        virtual_waiting = 0;
+        return deadline != 0 && virtual_now >= deadline ? ETIMEDOUT : 0;
+    }
+
+    if (deadline == 0)
+        return pthread_cond_wait(&alarm_cond, &alarm_mutex);
+
+    cond_time.tv_sec = deadline / 1000000000;
+    cond_time.tv_nsec = deadline % 1000000000;
+    return pthread_cond_timedwait(&alarm_cond, &alarm_mutex, &cond_time);
+}
+
+/**
+ * Handles alarms
+ */
+void *alarm_thread(void *arg) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int64_t head_time;
+    int64_t time;
+    int64_t fire_time;
+    int64_t wait_time;
+    int64_t now;
+    int64_t expired_time;
+    int status;
+    int expired;
+
+    /*
+     * Optionally pin this thread to a dedicated CPU (which main has
+     * checked we may run on). Like SCHED_FIFO below, this is only an
+     * optimization, so carry on unpinned if it is refused.
+     */
+    if (alarm_cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(alarm_cpu, &cpus);
+        status = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (status != 0)
+            fprintf(stderr, "Cannot pin to CPU %d: %s\n",
+                    alarm_cpu, strerror(status));
+    }
+
+    /*
+     * Optionally run this thread in the SCHED_FIFO class. This needs
+     * privileges that we may not have, so carry on without it if it
+     * is refused.
+     */
+    if (alarm_priority > 0) {
+        param.sched_priority = alarm_priority;
+        status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (status != 0)
+            fprintf(stderr, "Cannot use SCHED_FIFO: %s\n", strerror(status));
+    }
+
+    pthread_mutex_lock(&alarm_mutex);
+
+    while (1) {
+        // Set current_alarm to 0 to notify that this thread is idle
+        current_alarm = 0;
+
+        /*
+         * Wait for alarms to have a value, then look at (but do not
+         * remove) the next alarm to expire. It stays where it is
+         * while we wait, so that if an earlier alarm is inserted,
+         * there is nothing to put back.
+         */
+        while (!alarm_next(&head_time)) {
+            clock_wait(0);
+        }
+
+        now = now_ns();
+
+        if (now < head_time) {
+            /*
+             * If "now" is before the alarm, then we must wait for it
+             * to expire. We wait until the end of its slack window,
+             * so that any other alarm expiring before then can be
+             * fired in the same wakeup. In the low-latency mode, we
+             * only block until the spin window before that.
+             */
+            fire_time = head_time + slack;
+            wait_time = fire_time - spin_window;
+
+            current_alarm = head_time;
+            expired = 0;
+
+            /*
+             * Wait for timer to expire with a timed wait on the
+             * condition variable.
+             *
+             * We use a condition variable because while we are
+             * waiting, another alarm may be added to the array that
+             * must be handled befor the alarm currently being watied
+             * for.
+             */
+            while (current_alarm == head_time) {
+                if (now >= wait_time) {
+                    // Already inside the spin window.
+                    expired = 1;
+                    break;
+                }
+                status = clock_wait(wait_time);
+                /*
+                 * If we timed out, then the alarm has expired.
+                 */
+                if (status == ETIMEDOUT) {
+                    if (spin_window == 0)
+                        printf("Expired\n");
+                    expired = 1;
+                    break;
+                }
+            }
+
+            /*
+             * If alarm is not expired, then another alarm was added
+             * that must be handled first, so just start over.
+             */
+            if (!expired)
+                continue;
+
+            /*
+             * Low-latency mode: busy-poll the clock until the alarm
+             * is due. The mutex is released while spinning so that
+             * producers are not held up; an earlier alarm being
+             * inserted shows up as a change to current_alarm.
+             */
+            if (spin_window > 0) {
+                pthread_mutex_unlock(&alarm_mutex);
+                while (now_ns() < fire_time && current_alarm == head_time)
+                    ;
+                pthread_mutex_lock(&alarm_mutex);
+                if (current_alarm != head_time)
+                    continue;
+            }
+        }
+
+        /*
+         * Fire every alarm that has expired by now, starting from the
+         * one we waited for, without going back to wait for each one.
+         * Alarms that only became due within the slack window, and
+         * with a later expiry time than the one fired before them,
+         * would each have needed a wakeup of their own without slack,
+         * so count them as saved.
+         */
+        now = now_ns();
+        expired_time = head_time;
+        while (alarm_next(&time) && time <= now) {
+            if (time > expired_time && time > now - slack) {
+                wakeups_saved++;
+                expired_time = time;
+            }
+
+            record_latency(now_ns() - time);
+            alarm_fire_next();
+        }
+
+        // Let any producer blocked by admission control retry.
+        pthread_cond_broadcast(&alarm_space_cond);
+    }
+}
+
+/**
+ * Whether the submission ring has anything in it (for
+ * alarm_ring_sleep).
+ */
+int ring_ready(void *arg) {
+    return alarm_ring_peek(ring) != NULL;
+}
+
+/**
+ * Whether any slot of the submission ring has been reserved, whether
+ * or not it has been submitted yet (for alarm_ring_sleep).
+ */
+int ring_reserved(void *arg) {
+    return !alarm_ring_empty(ring);
+}
+
+/**
+ * Takes alarms that other processes have submitted through the
+ * shared-memory ring, and schedules them. Up to RING_BATCH alarms are
+ * scheduled per schedule_lock.
+ */
+void *ring_thread(void *arg) {
+    alarm_ring_request_t *slot;
+    alarm_ring_completion_t done;
+    alarm_origin_t origin;
+    int batch;
+    int status;
+
+    while (1) {
+        if (alarm_ring_peek(ring) == NULL) {
+            // Skip a slot that its (dead) client will never submit.
+            slot = alarm_ring_abandoned(ring);
+            if (slot != NULL) {
+                alarm_ring_release(ring, slot);
+                continue;
+            }
+
+            /*
+             * If the next slot is being filled in, its client rings
+             * the doorbell once it is done, unless it dies first: so
+             * only sleep for a while before checking on it again.
+             */
+            if (alarm_ring_filling(ring))
+                alarm_ring_sleep(&ring->doorbell, ring_ready, NULL,
+                                 ALARM_RING_RECHECK);
+            else
+                alarm_ring_sleep(&ring->doorbell, ring_reserved, NULL, 0);
+            continue;
+        }
+
+        schedule_lock();
+
+        for (batch = 0; batch < RING_BATCH; batch++) {
+            slot = alarm_ring_peek(ring);
+            if (slot == NULL)
+                break;
+
+            // Drop requests that name a completion ring that does not exist.
+            if (slot->client < ALARM_RING_CLIENTS) {
+                origin.source = ALARM_SOURCE_RING;
+                origin.generation = slot->generation;
+                origin.owner = slot->client;
+                origin.tag = slot->tag;
+                status = alarm_schedule(slot->seconds,
+                                        &origin,
+                                        slot->message,
+                                        strnlen(slot->message,
+                                                ALARM_RING_MESSAGE));
+                if (status != 0) {
+                    done.tag = slot->tag;
+                    done.status = status;
+                    done.seconds = slot->seconds;
+                    done.fired = 0;
+                    done.generation = slot->generation;
+                    /*
+                     * Completions are only posted with alarm_mutex
+                     * held, which schedule_lock does not take for the
+                     * skip list.
+                     */
+                    if (engine == ENGINE_SKIPLIST)
+                        pthread_mutex_lock(&alarm_mutex);
+                    alarm_ring_complete(ring, slot->client, &done);
+                    if (engine == ENGINE_SKIPLIST)
+                        pthread_mutex_unlock(&alarm_mutex);
+                }
+            }
+
+            alarm_ring_release(ring, slot);
+        }
+
+        schedule_unlock();
+    }
+}
+
+/**
+ * Create the shared-memory ring with the given name (replacing any
+ * left over from before), and start the thread that drains it.
+ */
+void ring_create(const char *name) {
+    pthread_t thread;
+    int status;
+    int fd;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1)
+        errno_abort("Create ring");
+    if (ftruncate(fd, sizeof(alarm_ring_t)) == -1)
+        errno_abort("Size ring");
+
+    ring = mmap(NULL, sizeof(alarm_ring_t), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        errno_abort("Map ring");
+    close(fd);
+
+    alarm_ring_init(ring);
+
+    status = pthread_create(&thread, NULL, ring_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create ring thread");
+}
+
+/**
+ * Append data to a growable buffer.
  */
-typedef struct alarm_linked_list {
-    alarm_t *alarm;
-    struct alarm_linked_list *next;
-} alarm_linked_list;
+void buffer_append(char **buffer, size_t *length, size_t *capacity,
+                   const char *data, size_t size) {
+    size_t new_capacity;
+
+    if (*length + size > *capacity) {
+        new_capacity = *capacity ? *capacity : 4096;
+        while (new_capacity < *length + size)
+            new_capacity *= 2;
+        *buffer = realloc(*buffer, new_capacity);
+        if (*buffer == NULL)
+            errno_abort("Grow connection buffer");
+        *capacity = new_capacity;
+    }
+
+    memcpy(*buffer + *length, data, size);
+    *length += size;
+}
 
 /**
- * Mutex that protects alarm_list.
+ * Queue a reply line on a connection. It is sent by the socket thread
+ * (see connection_send).
+ *
+ * THE SOCKET MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
  */
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+void connection_reply(uint32_t index, const char *format, ...) {
+    connection_t *connection = &connections[index];
+    char line[128];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length >= (int) sizeof(line))
+        length = sizeof(line) - 1;
+
+    /*
+     * A client that keeps sending requests without reading the
+     * replies would make us buffer them without limit. Drop them
+     * instead, and have connection_send shut the connection down.
+     */
+    if (connection->overflowed
+        || connection->output_length + length > SOCKET_OUTPUT_LIMIT) {
+        connection->overflowed = 1;
+        length = 0;
+    }
+
+    buffer_append(&connection->output, &connection->output_length,
+                  &connection->output_capacity, line, length);
+
+    if (!connection->dirty) {
+        connection->dirty = 1;
+        dirty_connections[dirty_count++] = index;
+    }
+}
 
 /**
- * Condition variable that that signals changes to alarm_list.
+ * Send as much of a connection's output as the socket will take
+ * without blocking, and have epoll tell us when it will take the
+ * rest.
+ *
+ * THE SOCKET MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
  */
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
+void connection_send(uint32_t index) {
+    connection_t *connection = &connections[index];
+    struct epoll_event event;
+    ssize_t sent;
+    int writing;
+
+    if (connection->fd == -1)
+        return;
+
+    /*
+     * Shutting the socket down (rather than closing it, which needs
+     * schedule_lock and so cannot be done here) makes it readable at
+     * end of file, and connection_read then closes it.
+     */
+    if (connection->overflowed) {
+        shutdown(connection->fd, SHUT_RDWR);
+        connection->output_length = 0;
+    }
+
+    while (connection->output_length > 0) {
+        sent = send(connection->fd, connection->output,
+                    connection->output_length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // The client is gone; reading will find that out.
+                connection->output_length = 0;
+            }
+            break;
+        }
+        memmove(connection->output, connection->output + sent,
+                connection->output_length - sent);
+        connection->output_length -= sent;
+    }
+
+    writing = connection->output_length > 0;
+    if (writing != connection->writing) {
+        event.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+        event.data.u64 = index;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == -1)
+            errno_abort("Watch connection");
+        connection->writing = writing;
+    }
+}
 
 /**
- * Linked list that holds the alarms.
+ * Send the output of every connection on dirty_connections.
+ *
+ * THE SOCKET MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
  */
-alarm_linked_list *alarm_list = NULL;
+void connection_send_dirty(void) {
+    size_t i;
+
+    for (i = 0; i < dirty_count; i++) {
+        connections[dirty_connections[i]].dirty = 0;
+        connection_send(dirty_connections[i]);
+    }
+    dirty_count = 0;
+}
 
 /**
- * current_alarm is 0 if the thread that handles alarms is idle. If
- * the alarm-handling thread is not idle, then current_alarm will have
- * the expiration (timestamp) value of the alarm being handled.
+ * Report an alarm to the connection that scheduled it, unless that
+ * connection has closed since. Called by alarm_notify, so lock order
+ * is always alarm_mutex, then socket_mutex.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
  */
-time_t current_alarm = 0;
+void socket_notify(const alarm_origin_t *origin, int status) {
+    connection_t *connection;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&socket_mutex);
+
+    connection = &connections[origin->owner];
+    if (connection->fd != -1 && connection->generation == origin->generation) {
+        if (status == 0)
+            connection_reply(origin->owner, "F %llu\n",
+                             (unsigned long long) origin->tag);
+        else
+            connection_reply(origin->owner, "E %llu %s\n",
+                             (unsigned long long) origin->tag,
+                             strerror(status));
+
+        // Wake the socket thread, unless that has already been done.
+        if (!wake_pending) {
+            wake_pending = 1;
+            if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+                errno_abort("Wake socket thread");
+        }
+    }
+
+    pthread_mutex_unlock(&socket_mutex);
+}
 
 /**
- * Print the list of alarms for debugging. This will only print if the
- * the -DDEBUG flag is enabled when compiling.
+ * Accept every pending connection.
  */
-void print_list() {
-#ifdef DEBUG /* Only define if -DDEBUG flag enabled. */
+void connection_accept(void) {
+    connection_t *connection;
+    struct epoll_event event;
+    size_t index;
+    size_t i;
+    int fd;
 
-    // Iterate through list, printing the contents of each alarm
-    alarm_linked_list *node;
-    printf("{");
-    for (node = alarm_list; node != NULL; node = node->next) {
-        printf("%lld (%lld) [\"%s\"]",
-               (long long) node->alarm->time,
-               (long long) node->alarm->time - time(NULL),
-               node->alarm->message);
-        // Put comma, unless it is the last item in the list
-        if (node->next != NULL) {
-            printf(", ");
+    while (1) {
+        fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EMFILE || errno == ENFILE) {
+                fprintf(stderr, "Accept connection: %s\n", strerror(errno));
+                return;
+            }
+            errno_abort("Accept connection");
+        }
+
+        pthread_mutex_lock(&socket_mutex);
+
+        for (index = 0; index < connection_capacity; index++) {
+            if (connections[index].fd == -1)
+                break;
+        }
+        if (index == connection_capacity) {
+            connection_capacity = connection_capacity
+                ? connection_capacity * 2 : 64;
+            connections = realloc(connections,
+                                  connection_capacity * sizeof(connection_t));
+            dirty_connections = realloc(dirty_connections,
+                                        connection_capacity
+                                        * sizeof(uint32_t));
+            if (connections == NULL || dirty_connections == NULL)
+                errno_abort("Grow connections");
+            for (i = index; i < connection_capacity; i++) {
+                memset(&connections[i], 0, sizeof(connection_t));
+                connections[i].fd = -1;
+            }
         }
+
+        connection = &connections[index];
+        connection->fd = fd;
+        connection->writing = 0;
+        connection->overflowed = 0;
+        connection->input_length = 0;
+        connection->output_length = 0;
+
+        pthread_mutex_unlock(&socket_mutex);
+
+        event.events = EPOLLIN;
+        event.data.u64 = index;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+            errno_abort("Watch connection");
     }
-    printf("}\n");
+}
 
-#endif
+/**
+ * Close a connection, and cancel its pending alarms, so that they do
+ * not hold on to admission control capacity until they would have
+ * fired. (Should one still get through, its generation no longer
+ * matches, so it is dropped.)
+ */
+void connection_close(uint32_t index) {
+    connection_t *connection = &connections[index];
+    alarm_origin_t origin;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+
+    origin.source = ALARM_SOURCE_SOCKET;
+    origin.generation = connection->generation;
+    origin.owner = index;
+    origin.tag = 0;
+    schedule_lock();
+    alarm_cancel_owner(&origin);
+    schedule_unlock();
+
+    pthread_mutex_lock(&socket_mutex);
+    connection->fd = -1;
+    connection->generation++;
+    connection->input_length = 0;
+    connection->output_length = 0;
+    pthread_mutex_unlock(&socket_mutex);
 }
 
 /**
- * Insert an alarm into the alarm list and possibly notify other
- * thread that an alarm has been inserted.
+ * State of a "Q" request while scanning the pending alarms.
+ */
+typedef struct {
+    uint32_t      index;
+    uint16_t      generation;
+    unsigned long count;
+} socket_query_t;
+
+/**
+ * alarm_range visitor for a "Q" request: report each of the
+ * connection's own alarms.
+ */
+int socket_query_alarm(int64_t time, int seconds,
+                       const alarm_payload_t *payload, void *arg) {
+    socket_query_t *query = arg;
+
+    if (payload->origin.source == ALARM_SOURCE_SOCKET
+        && payload->origin.owner == query->index
+        && payload->origin.generation == query->generation) {
+        pthread_mutex_lock(&socket_mutex);
+        connection_reply(query->index, "D %llu\n",
+                         (unsigned long long) payload->origin.tag);
+        pthread_mutex_unlock(&socket_mutex);
+        query->count++;
+    }
+    return 0;
+}
+
+/**
+ * Handle one request line from a connection:
  *
- * Special considerations:
- *   - since this function updates the alarm list, THE ALARM LIST
- *     MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ *   S <id> <seconds> <message>   schedule an alarm
+ *   C <id>                       cancel it
+ *   Q <id> <milliseconds>        list alarms due within that long
  *
- *   - list nodes for the alarm list are malloced, so keep in mind
- *     that they must be freed when consumed.
+ * The replies are "F <id>" when the alarm fires, "X <id>" when it is
+ * cancelled, and "E <id> <error>" when a request fails (or an alarm
+ * is shed). A query is answered with "D <alarm-id>" for each of the
+ * connection's alarms that is due (earliest first), then
+ * "Q <id> <count>".
+ *
+ * THE CALLER MUST HOLD schedule_lock.
  */
-void alarm_insert(alarm_t *alarm) {
+void socket_request(uint32_t index, char *line, size_t length) {
+    alarm_origin_t origin;
+    socket_query_t query;
+    unsigned long long tag = 0;
+    int milliseconds;
+    int seconds;
+    int offset = 0;
     int status;
-    alarm_linked_list *prev;
-    alarm_linked_list *next;
-    alarm_linked_list *new_alarm;
 
-    /*
-     * We have to allocate space for the linked list node because if
-     * we used a local variable it would disappear when the function
-     * ends (I learned this from a painful debugging session).
-     */
-    new_alarm = malloc(sizeof(alarm_linked_list));
-    if (new_alarm == NULL)
-        errno_abort("Allocate alarm linked list node");
+    if (length > 0 && line[length - 1] == '\r')
+        line[--length] = '\0';
 
-    // Attach alarm to the linked list node
-    new_alarm->alarm = alarm;
+    origin.source = ALARM_SOURCE_SOCKET;
+    origin.generation = connections[index].generation;
+    origin.owner = index;
 
-    prev = NULL;
-    next = alarm_list;
+    if (line[0] == 'S'
+        && sscanf(line, "S %llu %d %n", &tag, &seconds, &offset) == 2
+        && offset > 0
+        && line[offset] != '\0') {
+        origin.tag = tag;
+        status = alarm_schedule(seconds, &origin,
+                                line + offset, length - offset);
+    } else if (line[0] == 'C' && sscanf(line, "C %llu", &tag) == 1) {
+        origin.tag = tag;
+        status = alarm_cancel(&origin);
+        if (status == 0) {
+            pthread_mutex_lock(&socket_mutex);
+            connection_reply(index, "X %llu\n", tag);
+            pthread_mutex_unlock(&socket_mutex);
+        }
+    } else if (line[0] == 'Q'
+               && sscanf(line, "Q %llu %d", &tag, &milliseconds) == 2
+               && milliseconds >= 0) {
+        query.index = index;
+        query.generation = origin.generation;
+        query.count = 0;
+        alarm_range(INT64_MIN, now_ns() + (int64_t) milliseconds * 1000000,
+                    socket_query_alarm, &query);
+        pthread_mutex_lock(&socket_mutex);
+        connection_reply(index, "Q %llu %lu\n", tag, query.count);
+        pthread_mutex_unlock(&socket_mutex);
+        status = 0;
+    } else {
+        status = EINVAL;
+    }
 
-    // Iterate until the end of the list
-    while (next != NULL) {
-        /*
-         * When we find an alarm in the list that happens after the
-         * new alarm, insert the new alarm before it.
-         */
-        if (alarm->time <= next->alarm->time) {
-            /*
-             * Set the new alarm node's next pointer to the node that
-             * should be after it in the list.
-             */
-            new_alarm->next = next;
+    if (status != 0) {
+        pthread_mutex_lock(&socket_mutex);
+        connection_reply(index, "E %llu %s\n", tag, strerror(status));
+        pthread_mutex_unlock(&socket_mutex);
+    }
+}
 
-            /*
-             * If prev is NULL, then we are at the beginning of the
-             * list. In this case, set the list to this alarm so that
-             * it is at the front.
-             *
-             * Otherwise, just make the prev alarm node point to the
-             * new alarm node.
-             */
-            if (prev == NULL) {
-                alarm_list = new_alarm;
-            } else {
-                prev->next = new_alarm;
-            }
-            break;
+/**
+ * Read what a connection has sent, and handle every complete request
+ * line in it, in one batch under a single schedule_lock.
+ */
+void connection_read(uint32_t index) {
+    connection_t *connection = &connections[index];
+    size_t total = 0;
+    size_t start = 0;
+    ssize_t length;
+    char *newline;
+    int closed = 0;
+
+    while (total < SOCKET_READ_LIMIT) {
+        if (connection->input_capacity - connection->input_length < 4096) {
+            connection->input_capacity = connection->input_capacity
+                ? connection->input_capacity * 2 : 8192;
+            connection->input = realloc(connection->input,
+                                        connection->input_capacity);
+            if (connection->input == NULL)
+                errno_abort("Grow connection buffer");
         }
-        // Move forward in list
-        prev = next;
-        next = next->next;
-    }
 
-    /*
-     * If next == NULL at this point, then either:
-     *   - the above while loop did not execute (meaning that the list
-     *     was empty),
-     *
-     *   OR
-     *
-     *   - the above while loop completed without inserted the new
-     *     alarm (meaning that the new alarm needs to be inserted at
-     *     the end of the list).
-     */
-    if (next == NULL) {
-        if (prev == NULL) {
-            /*
-             * Case 1: list was empty so set alarm list to the new
-             *         alarm list node.
-             */
-            alarm_list = new_alarm;
+        length = read(connection->fd,
+                      connection->input + connection->input_length,
+                      connection->input_capacity - connection->input_length);
+        if (length > 0) {
+            connection->input_length += length;
+            total += length;
+        } else if (length == 0) {
+            closed = 1;
+            break;
+        } else if (errno == EINTR) {
+            continue;
         } else {
-            /*
-             * Case 2: alarm needs to be inserted at the end of the
-             *         list, so insert it there.
-             */
-            prev->next = new_alarm;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                closed = 1;
+            break;
         }
-        /*
-         * In both cases, the new alarm is at the end of the list. So
-         * the next node must be null.
-         */
-        new_alarm->next = NULL;
     }
 
-    // Print list. This will only happen if debug flag is enabled.
-    print_list();
+    schedule_lock();
+    while ((newline = memchr(connection->input + start, '\n',
+                             connection->input_length - start)) != NULL) {
+        *newline = '\0';
+        socket_request(index, connection->input + start,
+                       newline - (connection->input + start));
+        start = newline - connection->input + 1;
+    }
+    schedule_unlock();
 
-    /*
-     * If current_alarm is 0, then the other thread is idle. If
-     * current_alarm is greater than the new alarm, then the other
-     * thread is handling an alarm that happens after the new alarm.
-     * In both cases, we should set current_alarm to the new alarm, so
-     * that it gets handled now and, notify the other thread about
-     * this.
-     */
-    if (current_alarm == 0 || alarm->time < current_alarm) {
-        current_alarm = alarm->time;
-        pthread_cond_signal(&alarm_cond);
+    // Keep any partial line for next time.
+    memmove(connection->input, connection->input + start,
+            connection->input_length - start);
+    connection->input_length -= start;
+    if (connection->input_length > SOCKET_LINE_LIMIT)
+        closed = 1;
+
+    if (closed) {
+        connection_close(index);
+    } else {
+        pthread_mutex_lock(&socket_mutex);
+        connection_send_dirty();
+        pthread_mutex_unlock(&socket_mutex);
     }
 }
 
 /**
- * Handles alarms
+ * Serves the clients of the Unix domain socket.
  */
-void *alarm_thread(void *arg) {
-    alarm_t *alarm;
-    alarm_linked_list *alarm_l_l;
-    struct timespec cond_time;
-    time_t now;
-    int status;
-    int expired;
-
-    pthread_mutex_lock(&alarm_mutex);
+void *socket_thread(void *arg) {
+    struct epoll_event events[64];
+    uint64_t count;
+    uint64_t data;
+    int ready;
+    int i;
 
     while (1) {
-        // Set current_alarm to 0 to notify that this thread is idle
-        current_alarm = 0;
+        ready = epoll_wait(epoll_fd, events, 64, -1);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            errno_abort("Wait for events");
+        }
+
+        for (i = 0; i < ready; i++) {
+            data = events[i].data.u64;
 
-        // Wait for alarm_list to have a value.
-        while (alarm_list == NULL) {
-            pthread_cond_wait(&alarm_cond, &alarm_mutex);
+            if (data == EPOLL_LISTEN) {
+                connection_accept();
+            } else if (data == EPOLL_WAKE) {
+                if (read(wake_fd, &count, sizeof(count)) == -1
+                    && errno != EAGAIN)
+                    errno_abort("Read wake event");
+                pthread_mutex_lock(&socket_mutex);
+                wake_pending = 0;
+                connection_send_dirty();
+                pthread_mutex_unlock(&socket_mutex);
+            } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                connection_read(data);
+            } else if (events[i].events & EPOLLOUT) {
+                pthread_mutex_lock(&socket_mutex);
+                connection_send(data);
+                pthread_mutex_unlock(&socket_mutex);
+            }
         }
+    }
+}
 
-        // Make sure alarm_list has a value (this extra check protects
-        // against spurious wakeups).
-        if (alarm_list == NULL) {
-            printf("Spurious wakeup\n");
-        } else {
-            // Get alarm
-            alarm = alarm_list->alarm;
-            // Get alarm node
-            alarm_l_l = alarm_list;
-            // Remove alarm node from list
-            alarm_list = alarm_list->next;
+/**
+ * Listen on a Unix domain socket at the given path (replacing any left
+ * over from before), and start the thread that serves it.
+ */
+void socket_create(const char *path) {
+    struct sockaddr_un address;
+    struct epoll_event event;
+    pthread_t thread;
+    int status;
 
-            now = time(NULL);
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        exit(1);
+    }
 
-            expired = 0;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
 
-            if (now >= alarm->time) {
-                /*
-                 * If "now" is after the alarm, then it has expired
-                 * and we must print it.
-                 */
-                expired = 1;
-            } else {
-                /*
-                 * If "now" is before the alarm, then we must wait for
-                 * it to expire.
-                 */
-                cond_time.tv_sec = alarm->time;
-                cond_time.tv_nsec = 0;
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+        errno_abort("Create socket");
+    if (bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1)
+        errno_abort("Bind socket");
+    if (listen(listen_fd, SOMAXCONN) == -1)
+        errno_abort("Listen on socket");
 
-                current_alarm = alarm->time;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        errno_abort("Create epoll");
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1)
+        errno_abort("Create eventfd");
 
-                /*
-                 * Wait for timer to expire with a timed wait on the
-                 * condition variable.
-                 *
-                 * We use a condition variable because while we are
-                 * waiting, another alarm may be added to the list
-                 * that must be handled befor the alarm currently
-                 * being watied for.
-                 */
-                while (current_alarm == alarm->time) {
-                    status = pthread_cond_timedwait(&alarm_cond,
-                                                    &alarm_mutex,
-                                                    &cond_time);
-                    /*
-                     * If we timed out, then the alarm has expired.
-                     */
-                    if (status == ETIMEDOUT) {
-                        printf("Expired\n");
-                        expired = 1;
-                        break;
-                    }
-                }
+    event.events = EPOLLIN;
+    event.data.u64 = EPOLL_LISTEN;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1)
+        errno_abort("Watch socket");
+    event.data.u64 = EPOLL_WAKE;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1)
+        errno_abort("Watch eventfd");
 
-                /*
-                 * If alarm is not expired, then another alarm was
-                 * added to the list that must be handled first. In
-                 * this case, add the alarm that got interrupted back
-                 * into the list.
-                 */
-                if (!expired) {
-                    alarm_insert(alarm);
-                }
-            }
+    status = pthread_create(&thread, NULL, socket_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create socket thread");
+}
 
-            /*
-             * If the alarm is expired, print it, free the alarm, free
-             * the alarm linked list node.
-             */
-            if (expired) {
-                printf("(%d) %s\n", alarm->seconds, alarm->message);
-                free(alarm);
-                free(alarm_l_l);
-            }
+/**
+ * Print the statistics gathered so far.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void print_stats(void) {
+    printf("Wakeups saved by coalescing: %lu\n", wakeups_saved);
+    if (fired_count > 0)
+        printf("Fired %lu alarms, latency (usec): mean %.1f,"
+               " p50 <= %.1f, p99 <= %.1f, max %.1f\n",
+               fired_count,
+               latency_total / 1e3 / fired_count,
+               latency_percentile(0.50) / 1e3,
+               latency_percentile(0.99) / 1e3,
+               latency_max / 1e3);
+    if (max_alarms > 0 || max_memory > 0)
+        printf("Admission control: %lu blocked, %lu rejected, %lu shed\n",
+               admit_blocked, admit_rejected, admit_shed);
+}
+
+/**
+ * Move the virtual clock forward to the given time, letting the
+ * alarm-handling thread fire every alarm that comes due on the way.
+ * If to is 0, keep going until there are no alarms left.
+ *
+ * THE ALARM LIST MUTEX MUST BE LOCKED BY THE CALLER OF THIS METHOD.
+ */
+void virtual_advance(int64_t to) {
+    while (1) {
+        // Let the alarm-handling thread finish what it is doing.
+        while (!virtual_waiting)
+            pthread_cond_wait(&virtual_cond, &alarm_mutex);
+
+        if (virtual_deadline == 0 || (to != 0 && virtual_deadline > to))
+            break;
+
+        virtual_now = virtual_deadline;
+        virtual_waiting = 0;
+        pthread_cond_signal(&alarm_cond);
+    }
+
+    if (to > virtual_now)
+        virtual_now = to;
+}
+
+/**
+ * Replay the schedule on stdin against the virtual clock (-V), and
+ * report how fast it went. The clock only moves forward, so a line
+ * whose offset is earlier than the one before it is skipped (and
+ * counted) rather than scheduled late: sort a trace before replaying
+ * it.
+ */
+void virtual_replay(const alarm_origin_t *origin) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    double offset_ms;
+    int seconds;
+    int offset;
+    int64_t virtual_start = virtual_now;
+    int64_t start = real_ns();
+    int64_t when;
+    int64_t last = virtual_start;
+    double elapsed;
+    unsigned long scheduled = 0;
+    unsigned long refused = 0;
+    unsigned long out_of_order = 0;
+
+    while ((length = getline(&line, &line_size, stdin)) != -1) {
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+
+        offset = 0;
+        if (sscanf(line, "%lf %d %n", &offset_ms, &seconds, &offset) < 2
+            || offset == 0
+            || line[offset] == '\0') {
+            fprintf(stderr, "Bad command\n");
+            continue;
+        }
+
+        when = virtual_start + (int64_t) (offset_ms * 1e6);
+        if (when < last) {
+            fprintf(stderr, "Out of order: %s\n", line);
+            out_of_order++;
+            continue;
         }
+        last = when;
+
+        pthread_mutex_lock(&alarm_mutex);
+        virtual_advance(when);
+        pthread_mutex_unlock(&alarm_mutex);
+
+        schedule_lock();
+        if (alarm_schedule(seconds, origin,
+                           line + offset, length - offset) == 0)
+            scheduled++;
+        else
+            refused++;
+        schedule_unlock();
     }
+
+    pthread_mutex_lock(&alarm_mutex);
+    virtual_advance(0);
+    elapsed = (real_ns() - start) / 1e9;
+    print_stats();
+    printf("Replayed %lu alarms (%lu refused, %lu out of order) over %.1f"
+           " virtual seconds in %.3f seconds (%.0f alarms/sec)\n",
+           scheduled, refused, out_of_order,
+           (virtual_now - virtual_start) / 1e9,
+           elapsed, elapsed > 0 ? scheduled / elapsed : 0.0);
+    pthread_mutex_unlock(&alarm_mutex);
+
+    free(line);
 }
 
 /**
  * Main thread. Gets alarms from user and adds them to list.
  */
 int main(int argc, char *argv[]) {
-    int status;
-    char line[128];
-    alarm_t *alarm;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    char *message;
+    int offset;
+    int seconds;
+    const char *ring_name = NULL;
+    const char *socket_path = NULL;
+    alarm_origin_t stdin_origin = { ALARM_SOURCE_STDIN, 0, 0, 0 };
     pthread_t thread;
+    pthread_condattr_t cond_attr;
+    cpu_set_t cpus;
+    pthread_mutexattr_t mutex_attr;
+    int priority_inherit = 0;
+    int status;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:S:c:r:Pn:m:p:R:U:e:V")) != -1) {
+        switch (opt) {
+        case 's':
+            slack = atof(optarg) * 1e9;
+            break;
+        case 'S':
+            spin_window = atoll(optarg) * 1000;
+            break;
+        case 'c':
+            alarm_cpu = atoi(optarg);
+            break;
+        case 'r':
+            alarm_priority = atoi(optarg);
+            break;
+        case 'P':
+            priority_inherit = 1;
+            break;
+        case 'V':
+            virtual_clock = 1;
+            break;
+        case 'n':
+            max_alarms = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            max_memory = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            ring_name = optarg;
+            break;
+        case 'U':
+            socket_path = optarg;
+            break;
+        case 'e':
+            if (strcmp(optarg, "array") == 0)
+                engine = ENGINE_ARRAY;
+            else if (strcmp(optarg, "skiplist") == 0)
+                engine = ENGINE_SKIPLIST;
+            else
+                goto usage;
+            break;
+        case 'p':
+            if (strcmp(optarg, "block") == 0)
+                admission_policy = ADMIT_BLOCK;
+            else if (strcmp(optarg, "reject") == 0)
+                admission_policy = ADMIT_REJECT;
+            else if (strcmp(optarg, "shed") == 0)
+                admission_policy = ADMIT_SHED;
+            else
+                goto usage;
+            break;
+        default:
+        usage:
+            fprintf(stderr,
+                    "Usage: %s [-s slack-seconds] [-S spin-usec]"
+                    " [-c cpu] [-r fifo-priority] [-P]\n"
+                    "          [-n max-alarms] [-m max-bytes]"
+                    " [-p block|reject|shed]\n"
+                    "          [-R ring-name] [-U socket-path]"
+                    " [-e array|skiplist] [-V]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+
+    // Negative slack would spin with alarm_mutex held (see -s).
+    if (slack < 0) {
+        fprintf(stderr, "Slack must not be negative (see -s)\n");
+        exit(1);
+    }
+
+    // A negative spin window would quietly turn spinning off.
+    if (spin_window < 0) {
+        fprintf(stderr, "Spin window must not be negative (see -S)\n");
+        exit(1);
+    }
+
+    // The CPU for -c must be one this process is allowed to run on.
+    if (alarm_cpu >= 0) {
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+            errno_abort("Get CPU affinity");
+        if (alarm_cpu >= CPU_SETSIZE || !CPU_ISSET(alarm_cpu, &cpus)) {
+            fprintf(stderr, "CPU %d is not available (see -c)\n",
+                    alarm_cpu);
+            exit(1);
+        }
+    }
+
+    /*
+     * Only main moves the virtual clock, so nothing else may produce
+     * alarms, and producers must not block waiting for it to move.
+     * Spinning until a virtual time would never end.
+     */
+    if (virtual_clock) {
+        if (ring_name != NULL || socket_path != NULL
+            || ((max_alarms > 0 || max_memory > 0)
+                && admission_policy == ADMIT_BLOCK)) {
+            fprintf(stderr, "-V cannot be used with -R, -U,"
+                    " or the block admission policy\n");
+            exit(1);
+        }
+        spin_window = 0;
+    }
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&alarm_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    if (priority_inherit) {
+        pthread_mutexattr_init(&mutex_attr);
+        status = pthread_mutexattr_setprotocol(&mutex_attr,
+                                               PTHREAD_PRIO_INHERIT);
+        if (status != 0)
+            err_abort(status, "Set priority inheritance");
+        status = pthread_mutex_init(&alarm_mutex, &mutex_attr);
+        if (status != 0)
+            err_abort(status, "Init alarm mutex");
+        pthread_mutexattr_destroy(&mutex_attr);
+    }
+
+    if (engine == ENGINE_SKIPLIST)
+        skiplist_init(&alarm_skiplist);
+
+    if (ring_name != NULL)
+        ring_create(ring_name);
+    if (socket_path != NULL)
+        socket_create(socket_path);
 
     // Create alarm-handling thread
     pthread_create(&thread, NULL, alarm_thread, NULL);
 
+    if (virtual_clock) {
+        virtual_replay(&stdin_origin);
+        exit(0);
+    }
+
     while (1) {
         printf("Alarm > ");
 
-        // Get line from user
-        if (fgets(line, sizeof(line), stdin) == NULL)
+        /*
+         * Get line from user. getline grows the buffer as needed, so
+         * messages of any length are kept whole.
+         */
+        length = getline(&line, &line_size, stdin);
+        if (length == -1) {
+            pthread_mutex_lock(&alarm_mutex);
+            print_stats();
+            pthread_mutex_unlock(&alarm_mutex);
+
+            /*
+             * If other processes can still submit alarms through the
+             * ring or the socket, keep serving them after the end of
+             * stdin.
+             */
+            if (ring != NULL || listen_fd != -1)
+                pthread_exit(NULL);
             exit(0);
+        }
+
+        // Strip the newline
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
 
         // Make sure line had a value
-        if (strlen(line) <= 1)
+        if (length == 0)
             continue;
 
-        // Allocate memory for alarm (must be freed when handled)
-        alarm = malloc(sizeof(alarm_t));
-        if (alarm == NULL)
-            errno_abort("Allocate alarm");
-
-        // Parse the line, making sure alarm fits the correct format
-        if (sscanf(line,
-                   "%d %64[^\n]",
-                   &alarm->seconds,
-                   alarm->message) < 2)
+        /*
+         * Parse the line, making sure alarm fits the correct format:
+         * a number of seconds, then a (non-empty) message.
+         */
+        offset = 0;
+        if (sscanf(line, "%d %n", &seconds, &offset) < 1
+            || offset == 0
+            || line[offset] == '\0')
         {
             fprintf(stderr, "Bad command\n");
-            // Free alarm if the command had an invalid format,
-            // because it will not be handled and freed later.
-            free(alarm);
         } else {
-            pthread_mutex_lock(&alarm_mutex);
-
-            // Calculate absolute expiry time for the alarm.
-            alarm->time = time(NULL) + alarm->seconds;
+            message = line + offset;
 
-            // Insert the alarm into the list.
-            alarm_insert(alarm);
+            schedule_lock();
+            status = alarm_schedule(seconds, &stdin_origin,
+                                    message, strlen(message));
+            schedule_unlock();
 
-            pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                fprintf(stderr, "Alarm refused: %s\n", strerror(status));
         }
     }
 }
-
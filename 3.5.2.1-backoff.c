@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include "errors.h"
+#include "lock_trace.h"
 
 #define ITERATIONS 10
 
@@ -38,21 +39,23 @@ void *lock_forward(void *arg) {
     int backoffs;
     int status;
 
+    lock_trace_thread("forward");
+
     for (int i = 0; i < ITERATIONS; i++) {
         backoffs = 0;
 
         for (int j = 0; j < 3; j++) {
             if (j == 0) {
                 printf("1:11\n");
-                status = pthread_mutex_lock(&mutex[0]);
+                status = lock_trace_lock(&mutex[0]);
                 if (status != 0)
                     err_abort(status, "First lock");
             } else {
                 printf("1:22\n");
                 if (backoff)
-                    status = pthread_mutex_trylock(&mutex[j]);
+                    status = lock_trace_trylock(&mutex[j]);
                 else
-                    status = pthread_mutex_lock(&mutex[j]);
+                    status = lock_trace_lock(&mutex[j]);
 
                 if (status == EBUSY) {
                     backoffs++;
@@ -62,7 +65,7 @@ void *lock_forward(void *arg) {
                     // backoffs in other threads).
                     for ( ; j > 0; j--) {
                         printf("1un\n");
-                        status = pthread_mutex_unlock(&mutex[j-1]);
+                        status = lock_trace_unlock(&mutex[j-1]);
                         if (status != 0)
                             err_abort(status, "Backoff");
                     }
@@ -85,7 +88,7 @@ void *lock_forward(void *arg) {
         // of other threads having to backoff).
         for (int k = 2; k >= 0; k--) {
             printf("1f\n");
-            pthread_mutex_unlock(&mutex[k]);
+            lock_trace_unlock(&mutex[k]);
         }
     }
 
@@ -103,21 +106,23 @@ void *lock_backward(void *arg) {
     int backoffs;
     int status;
 
+    lock_trace_thread("backward");
+
     for (int i = 0; i < ITERATIONS; i++) {
         backoffs = 0;
 
         for (int j = 2; j >= 0; j--) {
             if (j == 2) {
                 printf("2:11\n");
-                status = pthread_mutex_lock(&mutex[2]);
+                status = lock_trace_lock(&mutex[2]);
                 if (status != 0)
                     err_abort(status, "First lock");
             } else {
                 printf("2:22\n");
                 if (backoff)
-                    status = pthread_mutex_trylock(&mutex[j]);
+                    status = lock_trace_trylock(&mutex[j]);
                 else
-                    status = pthread_mutex_lock(&mutex[j]);
+                    status = lock_trace_lock(&mutex[j]);
 
                 if (status == EBUSY) {
                     backoffs++;
@@ -130,7 +135,7 @@ void *lock_backward(void *arg) {
                     // backoffs in other threads).
                     for ( ; j < 2; j++) {
                         printf("2un\n");
-                        status = pthread_mutex_unlock(&mutex[j+1]);
+                        status = lock_trace_unlock(&mutex[j+1]);
                         if (status != 0)
                             err_abort(status, "Backoff");
                     }
@@ -154,7 +159,7 @@ void *lock_backward(void *arg) {
         // of other threads having to backoff).
         for (int k = 0; k < 3; k++) {
             printf("2f\n");
-            pthread_mutex_unlock(&mutex[k]);
+            lock_trace_unlock(&mutex[k]);
         }
     }
 
@@ -173,6 +178,12 @@ int main(int argc, char *argv[]) {
     if (argc > 2)
         yieldFlag = atoi(argv[2]);
 
+    // Trace the mutexes if LOCK_TRACE is set (see lock_trace.h).
+    lock_trace_init();
+    lock_trace_name(&mutex[0], "mutex 0");
+    lock_trace_name(&mutex[1], "mutex 1");
+    lock_trace_name(&mutex[2], "mutex 2");
+
     status = pthread_create(&forward, NULL, lock_forward, NULL);
     if (status != 0)
         err_abort(status, "Create forward");
@@ -181,6 +192,17 @@ int main(int argc, char *argv[]) {
     if (status != 0)
         err_abort(status, "Create backward");
 
-    pthread_exit(NULL);
+    /*
+     * Join rather than pthread_exit, so that main returns (and the
+     * trace, if any, is written) once both threads are done.
+     */
+    status = pthread_join(forward, NULL);
+    if (status != 0)
+        err_abort(status, "Join forward");
+    status = pthread_join(backward, NULL);
+    if (status != 0)
+        err_abort(status, "Join backward");
+
+    return 0;
 }
 
@@ -0,0 +1,325 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "errors.h"
+#include "alarm_ring.h"
+
+/*
+ * Client for the shared-memory ring of 3.3.4-alarm_cond.c (started
+ * with -R ring-name). Submits alarms without a system call per alarm,
+ * and prints them as the scheduler reports them fired.
+ *
+ * Usage: alarm-client [-n count] [-s seconds] ring-name
+ *
+ * Without -n, alarms are read from stdin in the same format as the
+ * scheduler itself reads them, except that messages must fit in a
+ * ring slot (ALARM_RING_MESSAGE - 1 bytes); longer ones are refused
+ * rather than cut short. With -n, count alarms of the given
+ * number of seconds are submitted as fast as possible, and only a
+ * summary is printed.
+ */
+
+alarm_ring_t *ring;
+int client;
+uint16_t generation;
+
+/*
+ * Messages of the alarms submitted from stdin, indexed by tag, so
+ * that they can be printed when they fire. Protected by
+ * message_mutex, since the completion thread reads them while main
+ * adds to them.
+ */
+pthread_mutex_t message_mutex = PTHREAD_MUTEX_INITIALIZER;
+char **messages = NULL;
+size_t message_capacity = 0;
+
+long count = 0;
+int seconds = 0;
+
+/*
+ * Progress, shared between main and the completion thread.
+ */
+atomic_ulong submitted = 0;
+atomic_int input_done = 0;
+atomic_ulong completed = 0;
+unsigned long refused = 0;
+unsigned long full_retries = 0;
+unsigned long capacity_waits = 0;
+int64_t latency_total = 0;
+int64_t latency_max = 0;
+
+/*
+ * Rung by the completion thread for main, when main is waiting for
+ * room in the completion ring. It lives in this process only, but
+ * works just as well as the doorbells in the ring.
+ */
+alarm_ring_doorbell_t capacity;
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Whether another alarm can be submitted without overflowing the
+ * completion ring (for alarm_ring_sleep).
+ */
+static int has_capacity(void *arg) {
+    return atomic_load(&submitted) - atomic_load(&completed)
+        < ALARM_RING_COMPLETIONS;
+}
+
+/*
+ * Submit one alarm. The message is written straight into the shared
+ * slot, and the scheduler is only woken (with a system call) if it is
+ * asleep.
+ *
+ * No more alarms than fit in the completion ring are ever
+ * outstanding, so that the scheduler never has to drop a completion:
+ * until one completes, we sleep on the capacity doorbell.
+ */
+static void submit(int seconds, const char *message) {
+    alarm_ring_request_t *slot;
+
+    if (!has_capacity(NULL)) {
+        capacity_waits++;
+        alarm_ring_sleep(&capacity, has_capacity, NULL, 0);
+    }
+
+    while ((slot = alarm_ring_reserve(ring)) == NULL) {
+        full_retries++;
+        sched_yield();
+    }
+
+    slot->client = client;
+    slot->generation = generation;
+    slot->seconds = seconds;
+    /*
+     * The tag is the index of the message for stdin alarms, and the
+     * expected expiry time (to work out latency from) for generated
+     * ones. That is taken from now, once we have a slot, so that
+     * waiting for one does not count as latency.
+     */
+    slot->tag = count > 0
+        ? (uint64_t) (now_ns() + (int64_t) seconds * 1000000000)
+        : atomic_load(&submitted);
+    strncpy(slot->message, message, ALARM_RING_MESSAGE - 1);
+    slot->message[ALARM_RING_MESSAGE - 1] = '\0';
+
+    atomic_fetch_add(&submitted, 1);
+    alarm_ring_submit(ring, slot);
+}
+
+/*
+ * Whether every alarm submitted has been reported (or its report was
+ * dropped because we did not keep up).
+ */
+static int all_reported(void) {
+    return atomic_load(&input_done)
+        && completed + atomic_load(&ring->completions[client].dropped)
+           >= atomic_load(&submitted);
+}
+
+/*
+ * Whether the completion thread has something to do (for
+ * alarm_ring_sleep).
+ */
+static int completion_ready(void *arg) {
+    alarm_ring_completions_t *completions = &ring->completions[client];
+
+    return atomic_load(&completions->head) != atomic_load(&completions->tail)
+        || all_reported();
+}
+
+void *completion_thread(void *arg) {
+    alarm_ring_completion_t done;
+    int64_t latency;
+
+    while (!all_reported()) {
+        if (alarm_ring_reap(ring, client, &done) != 0) {
+            alarm_ring_sleep(&ring->completions[client].doorbell,
+                             completion_ready, NULL, 0);
+            continue;
+        }
+
+        // Left over from a client that had this ring before us.
+        if (done.generation != generation)
+            continue;
+
+        atomic_fetch_add(&completed, 1);
+        alarm_ring_ring(&capacity);
+
+        if (done.status != 0) {
+            refused++;
+            if (count == 0) {
+                pthread_mutex_lock(&message_mutex);
+                fprintf(stderr, "Alarm refused: (%d) %s: %s\n",
+                        done.seconds, messages[done.tag],
+                        strerror(done.status));
+                pthread_mutex_unlock(&message_mutex);
+            }
+        } else if (count > 0) {
+            latency = done.fired - (int64_t) done.tag;
+            latency_total += latency;
+            if (latency > latency_max)
+                latency_max = latency;
+        } else {
+            pthread_mutex_lock(&message_mutex);
+            printf("(%d) %s\n", done.seconds, messages[done.tag]);
+            pthread_mutex_unlock(&message_mutex);
+        }
+    }
+
+    return NULL;
+}
+
+static void ring_attach(const char *name) {
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        errno_abort("Open ring");
+    ring = mmap(NULL, sizeof(alarm_ring_t), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        errno_abort("Map ring");
+    close(fd);
+
+    if (atomic_load(&ring->magic) != ALARM_RING_MAGIC) {
+        fprintf(stderr, "%s is not an alarm ring\n", name);
+        exit(1);
+    }
+
+    client = alarm_ring_attach(ring, &generation);
+    if (client < 0) {
+        fprintf(stderr, "All %d client slots are in use\n",
+                ALARM_RING_CLIENTS);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    int offset;
+    int line_seconds;
+    pthread_t thread;
+    int64_t start, elapsed;
+    int status;
+    int opt;
+    long i;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+    usage:
+        fprintf(stderr, "Usage: %s [-n count] [-s seconds] ring-name\n",
+                argv[0]);
+        exit(1);
+    }
+
+    ring_attach(argv[optind]);
+    alarm_ring_doorbell_init(&capacity);
+
+    status = pthread_create(&thread, NULL, completion_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create completion thread");
+
+    start = now_ns();
+
+    if (count > 0) {
+        for (i = 0; i < count; i++)
+            submit(seconds, "");
+    } else {
+        while (1) {
+            printf("Alarm > ");
+            length = getline(&line, &line_size, stdin);
+            if (length == -1)
+                break;
+            if (length > 0 && line[length - 1] == '\n')
+                line[--length] = '\0';
+            if (length == 0)
+                continue;
+
+            offset = 0;
+            if (sscanf(line, "%d %n", &line_seconds, &offset) < 1
+                || offset == 0
+                || line[offset] == '\0') {
+                fprintf(stderr, "Bad command\n");
+                continue;
+            }
+            if (length - offset > ALARM_RING_MESSAGE - 1) {
+                fprintf(stderr, "Message too long (at most %d bytes)\n",
+                        ALARM_RING_MESSAGE - 1);
+                continue;
+            }
+
+            // Keep the message, to print when the alarm fires.
+            pthread_mutex_lock(&message_mutex);
+            if (atomic_load(&submitted) == message_capacity) {
+                message_capacity = message_capacity ? message_capacity * 2
+                                                    : 64;
+                messages = realloc(messages,
+                                   message_capacity * sizeof(char*));
+                if (messages == NULL)
+                    errno_abort("Grow messages");
+            }
+            messages[atomic_load(&submitted)] = strdup(line + offset);
+            pthread_mutex_unlock(&message_mutex);
+
+            submit(line_seconds, line + offset);
+        }
+    }
+
+    elapsed = now_ns() - start;
+
+    /*
+     * Let the completion thread finish once everything submitted has
+     * been reported, waking it in case it is already asleep.
+     */
+    atomic_store(&input_done, 1);
+    alarm_ring_ring(&ring->completions[client].doorbell);
+
+    status = pthread_join(thread, NULL);
+    if (status != 0)
+        err_abort(status, "Join completion thread");
+
+    if (count > 0) {
+        printf("Submitted %lu alarms in %.3f seconds (%.0f/sec),"
+               " %lu waits for completions,"
+               " %lu retries on a full ring\n",
+               atomic_load(&submitted), elapsed / 1e9,
+               atomic_load(&submitted) / (elapsed / 1e9),
+               capacity_waits, full_retries);
+        if (atomic_load(&completed) > refused)
+            printf("Fired %lu, refused %lu, latency (usec):"
+                   " mean %.1f, max %.1f\n",
+                   atomic_load(&completed) - refused, refused,
+                   latency_total / 1e3 / (atomic_load(&completed) - refused),
+                   latency_max / 1e3);
+    }
+    if (atomic_load(&ring->completions[client].dropped) > 0)
+        printf("%lu completions were dropped\n",
+               (unsigned long)
+               atomic_load(&ring->completions[client].dropped));
+
+    alarm_ring_detach(ring, client);
+    return 0;
+}
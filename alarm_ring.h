@@ -0,0 +1,452 @@
+#ifndef __alarm_ring_h
+#define __alarm_ring_h
+
+/*
+ * Shared-memory submission and completion rings, through which other
+ * local processes (see alarm-client.c) hand alarms to
+ * 3.3.4-alarm_cond.c without a system call per alarm.
+ *
+ * The scheduler creates a POSIX shared memory object (shm_open) that
+ * holds one alarm_ring_t. Clients map it and:
+ *
+ *   - claim one of the ALARM_RING_CLIENTS completion rings (taking
+ *     over the ring of a client that died without releasing it),
+ *
+ *   - submit alarms by reserving a slot in the (lock-free, multiple
+ *     producer) submission ring, filling it in place, and publishing
+ *     it (a slot reserved by a client that died before publishing it
+ *     is skipped by the scheduler, rather than holding up the ring),
+ *
+ *   - read the results (fired, or refused by admission control) from
+ *     their own (single producer, single consumer) completion ring.
+ *     A client must not have more than ALARM_RING_COMPLETIONS alarms
+ *     outstanding, or the scheduler has to drop completions.
+ *
+ * Each claim of a completion ring bumps its generation, which is
+ * carried by every submission and completion, so that the alarms of a
+ * client that has gone are not reported to the next one.
+ *
+ * The process-shared mutex and condition variable of each ring are
+ * only used to sleep when there is nothing to do: a producer only
+ * makes the system call to wake the consumer when the consumer has
+ * said (with its waiting flag) that it is asleep.
+ *
+ * The atomics in here must be lock-free (and so address-free) to work
+ * between processes, which they are on the usual 64-bit platforms.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+
+#define ALARM_RING_MAGIC       0x414c524d   // "ALRM"
+#define ALARM_RING_SLOTS       1024         // Must be a power of two.
+#define ALARM_RING_COMPLETIONS 1024         // Must be a power of two.
+#define ALARM_RING_CLIENTS     64
+#define ALARM_RING_MESSAGE     112
+#define ALARM_RING_RECHECK     10000000     // Nanoseconds; see ring_thread.
+
+/*
+ * One alarm submitted by a client. sequence is used (as in Dmitry
+ * Vyukov's bounded queue) to tell whether the slot is free for
+ * producers, or filled in and ready for the consumer.
+ */
+typedef struct {
+    _Atomic uint64_t sequence;
+    _Atomic int32_t  pid;      // Of the client that reserved it, or 0.
+    uint32_t         client;   // Completion ring to report to.
+    int32_t          seconds;
+    uint64_t         tag;      // Client's identifier for the alarm.
+    uint16_t         generation; // Of the completion ring.
+    char             message[ALARM_RING_MESSAGE];
+} alarm_ring_request_t;
+
+/*
+ * Result of one alarm. status is 0 if the alarm fired (at fired, in
+ * nanoseconds on CLOCK_MONOTONIC), or an errno value if the scheduler
+ * refused (EAGAIN) or dropped (ECANCELED) it.
+ */
+typedef struct {
+    uint64_t tag;
+    int32_t  status;
+    int32_t  seconds;
+    int64_t  fired;
+    uint16_t generation;
+} alarm_ring_completion_t;
+
+/*
+ * Mutex and condition variable used by a ring's consumer to sleep.
+ */
+typedef struct {
+    _Atomic uint32_t waiting;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+} alarm_ring_doorbell_t;
+
+/*
+ * Completion ring of one client. The scheduler only posts to it with
+ * alarm_mutex held, so there is a single producer. owner is the pid of
+ * the client that claimed it (0 while it is being claimed).
+ */
+typedef struct {
+    _Atomic uint32_t        in_use;
+    _Atomic int32_t         owner;
+    _Atomic uint16_t        generation;
+    _Atomic uint64_t        head __attribute__((aligned(64)));
+    _Atomic uint64_t        tail __attribute__((aligned(64)));
+    _Atomic uint64_t        dropped;
+    alarm_ring_doorbell_t   doorbell;
+    alarm_ring_completion_t entries[ALARM_RING_COMPLETIONS];
+} alarm_ring_completions_t;
+
+typedef struct {
+    _Atomic uint32_t         magic;
+    _Atomic uint64_t         enqueue __attribute__((aligned(64)));
+    _Atomic uint64_t         dequeue __attribute__((aligned(64)));
+    alarm_ring_doorbell_t    doorbell;
+    alarm_ring_request_t     slots[ALARM_RING_SLOTS];
+    alarm_ring_completions_t completions[ALARM_RING_CLIENTS];
+} alarm_ring_t;
+
+/*
+ * Lock a process-shared (robust) mutex. If another process died while
+ * holding it, the state it protects is only ever the doorbell's
+ * waiting flag, which is safe to carry on with.
+ */
+static inline void alarm_ring_lock(pthread_mutex_t *mutex) {
+    int status;
+
+    status = pthread_mutex_lock(mutex);
+    if (status == EOWNERDEAD)
+        status = pthread_mutex_consistent(mutex);
+    if (status != 0)
+        err_abort(status, "Lock ring mutex");
+}
+
+static inline void alarm_ring_cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t cond_attr;
+    int status;
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    status = pthread_cond_init(cond, &cond_attr);
+    if (status != 0)
+        err_abort(status, "Init ring condition");
+    pthread_condattr_destroy(&cond_attr);
+}
+
+static inline void alarm_ring_doorbell_init(alarm_ring_doorbell_t *doorbell) {
+    pthread_mutexattr_t mutex_attr;
+    int status;
+
+    atomic_init(&doorbell->waiting, 0);
+
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    status = pthread_mutex_init(&doorbell->mutex, &mutex_attr);
+    if (status != 0)
+        err_abort(status, "Init ring mutex");
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    alarm_ring_cond_init(&doorbell->cond);
+}
+
+/*
+ * Start the doorbell of a completion ring afresh, for its new owner.
+ * If the last owner died asleep in alarm_ring_sleep, the condition
+ * variable still counts it as a waiter, and would not wake the new
+ * one. Nobody else can be waiting on it, and the scheduler only
+ * signals it with the mutex held.
+ */
+static inline void alarm_ring_doorbell_reset(alarm_ring_doorbell_t *doorbell) {
+    alarm_ring_lock(&doorbell->mutex);
+    atomic_store(&doorbell->waiting, 0);
+    memset(&doorbell->cond, 0, sizeof(doorbell->cond));
+    alarm_ring_cond_init(&doorbell->cond);
+    pthread_mutex_unlock(&doorbell->mutex);
+}
+
+/*
+ * Wake the consumer, but only if it is asleep. The producer must
+ * already have published its work with a sequentially consistent
+ * store, which pairs with the consumer setting waiting before it
+ * checks for work one last time (see alarm_ring_sleep).
+ */
+static inline void alarm_ring_ring(alarm_ring_doorbell_t *doorbell) {
+    if (atomic_load(&doorbell->waiting)) {
+        alarm_ring_lock(&doorbell->mutex);
+        pthread_cond_signal(&doorbell->cond);
+        pthread_mutex_unlock(&doorbell->mutex);
+    }
+}
+
+/*
+ * Sleep until a producer rings the doorbell, unless ready() (called
+ * after announcing that we are about to sleep) finds work. If timeout
+ * is not 0, give up after that many nanoseconds.
+ *
+ * Like pthread_mutex_lock, a wait reacquires the robust mutex, and so
+ * may find that its last owner died (see alarm_ring_lock).
+ */
+static inline void alarm_ring_sleep(alarm_ring_doorbell_t *doorbell,
+                                    int (*ready)(void *), void *arg,
+                                    int64_t timeout) {
+    struct timespec deadline;
+    int status;
+
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (deadline.tv_nsec + timeout) / 1000000000;
+        deadline.tv_nsec = (deadline.tv_nsec + timeout) % 1000000000;
+    }
+
+    alarm_ring_lock(&doorbell->mutex);
+    atomic_store(&doorbell->waiting, 1);
+    while (!ready(arg)) {
+        if (timeout > 0)
+            status = pthread_cond_timedwait(&doorbell->cond,
+                                            &doorbell->mutex, &deadline);
+        else
+            status = pthread_cond_wait(&doorbell->cond, &doorbell->mutex);
+        if (status == EOWNERDEAD)
+            status = pthread_mutex_consistent(&doorbell->mutex);
+        if (status == ETIMEDOUT)
+            break;
+        if (status != 0)
+            err_abort(status, "Wait on ring condition");
+    }
+    atomic_store(&doorbell->waiting, 0);
+    pthread_mutex_unlock(&doorbell->mutex);
+}
+
+/*
+ * Initialize a freshly created (zero-filled) ring.
+ */
+static inline void alarm_ring_init(alarm_ring_t *ring) {
+    uint64_t i;
+
+    atomic_init(&ring->enqueue, 0);
+    atomic_init(&ring->dequeue, 0);
+    alarm_ring_doorbell_init(&ring->doorbell);
+    for (i = 0; i < ALARM_RING_SLOTS; i++)
+        atomic_init(&ring->slots[i].sequence, i);
+    for (i = 0; i < ALARM_RING_CLIENTS; i++)
+        alarm_ring_doorbell_init(&ring->completions[i].doorbell);
+
+    // Clients check the magic number before using anything else.
+    atomic_store(&ring->magic, ALARM_RING_MAGIC);
+}
+
+/*
+ * Claim a completion ring that is free, or whose owner has died (and
+ * so never detached). Returns its index, and its new generation in
+ * *generation, or -1 if all are taken.
+ */
+static inline int alarm_ring_attach(alarm_ring_t *ring, uint16_t *generation) {
+    alarm_ring_completions_t *completions;
+    uint32_t expected;
+    int32_t owner;
+    int claimed;
+    int i;
+
+    for (i = 0; i < ALARM_RING_CLIENTS; i++) {
+        completions = &ring->completions[i];
+        expected = 0;
+        claimed = atomic_compare_exchange_strong(&completions->in_use,
+                                                 &expected, 1);
+        if (claimed) {
+            atomic_store(&completions->owner, getpid());
+        } else {
+            owner = atomic_load(&completions->owner);
+            claimed = owner != 0
+                && kill(owner, 0) == -1 && errno == ESRCH
+                && atomic_compare_exchange_strong(&completions->owner,
+                                                  &owner, getpid());
+            if (claimed)
+                alarm_ring_doorbell_reset(&completions->doorbell);
+        }
+        if (claimed) {
+            /*
+             * Bump the generation before discarding what is in the
+             * ring: completions for the last owner that are still on
+             * their way are then either discarded, or posted with the
+             * old generation and skipped by the new owner.
+             */
+            *generation = atomic_fetch_add(&completions->generation, 1) + 1;
+            atomic_store(&completions->head,
+                         atomic_load(&completions->tail));
+            atomic_store(&completions->dropped, 0);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline void alarm_ring_detach(alarm_ring_t *ring, int client) {
+    atomic_store(&ring->completions[client].owner, 0);
+    atomic_store(&ring->completions[client].in_use, 0);
+}
+
+/*
+ * Reserve a submission slot. Returns NULL if the ring is full. The
+ * caller fills in the slot, then hands it over with
+ * alarm_ring_submit.
+ */
+static inline alarm_ring_request_t *alarm_ring_reserve(alarm_ring_t *ring) {
+    alarm_ring_request_t *slot;
+    uint64_t position;
+    int64_t difference;
+
+    position = atomic_load_explicit(&ring->enqueue, memory_order_relaxed);
+    while (1) {
+        slot = &ring->slots[position & (ALARM_RING_SLOTS - 1)];
+        difference = (int64_t) (atomic_load_explicit(&slot->sequence,
+                                                     memory_order_acquire)
+                                - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue,
+                                                      &position,
+                                                      position + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                atomic_store(&slot->pid, getpid());
+                return slot;
+            }
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = atomic_load_explicit(&ring->enqueue,
+                                            memory_order_relaxed);
+        }
+    }
+}
+
+static inline void alarm_ring_submit(alarm_ring_t *ring,
+                                     alarm_ring_request_t *slot) {
+    uint64_t position = atomic_load_explicit(&slot->sequence,
+                                             memory_order_relaxed);
+
+    atomic_store(&slot->sequence, position + 1);
+    alarm_ring_ring(&ring->doorbell);
+}
+
+/*
+ * Take the next filled-in slot, for the (single) consumer. Returns
+ * NULL if there is none. The consumer hands the slot back with
+ * alarm_ring_release once it has copied what it needs.
+ */
+static inline alarm_ring_request_t *alarm_ring_peek(alarm_ring_t *ring) {
+    alarm_ring_request_t *slot;
+    uint64_t position;
+
+    position = atomic_load_explicit(&ring->dequeue, memory_order_relaxed);
+    slot = &ring->slots[position & (ALARM_RING_SLOTS - 1)];
+    if (atomic_load(&slot->sequence) != position + 1)
+        return NULL;
+    return slot;
+}
+
+static inline void alarm_ring_release(alarm_ring_t *ring,
+                                      alarm_ring_request_t *slot) {
+    uint64_t position;
+
+    atomic_store_explicit(&slot->pid, 0, memory_order_relaxed);
+    position = atomic_load_explicit(&ring->dequeue, memory_order_relaxed);
+    atomic_store_explicit(&ring->dequeue, position + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, position + ALARM_RING_SLOTS,
+                          memory_order_release);
+}
+
+/*
+ * Whether no slot has been reserved since the consumer last released
+ * one.
+ */
+static inline int alarm_ring_empty(alarm_ring_t *ring) {
+    return atomic_load(&ring->enqueue)
+        == atomic_load_explicit(&ring->dequeue, memory_order_relaxed);
+}
+
+/*
+ * Whether the next slot has been reserved, but not yet submitted.
+ */
+static inline int alarm_ring_filling(alarm_ring_t *ring) {
+    return !alarm_ring_empty(ring) && alarm_ring_peek(ring) == NULL;
+}
+
+/*
+ * If the next slot was reserved by a client that died before
+ * submitting it, return it, for the consumer to hand back unread with
+ * alarm_ring_release (otherwise it would wait for it forever).
+ * Returns NULL if there is no such slot.
+ *
+ * A client that dies after reserving a slot but before recording its
+ * pid there (a few instructions) still holds up the ring, as does one
+ * whose pid has been reused.
+ */
+static inline alarm_ring_request_t *alarm_ring_abandoned(alarm_ring_t *ring) {
+    alarm_ring_request_t *slot;
+    uint64_t position;
+    int32_t pid;
+
+    if (!alarm_ring_filling(ring))
+        return NULL;
+    position = atomic_load_explicit(&ring->dequeue, memory_order_relaxed);
+    slot = &ring->slots[position & (ALARM_RING_SLOTS - 1)];
+    pid = atomic_load(&slot->pid);
+    if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH)
+        return NULL;
+    return slot;
+}
+
+/*
+ * Post a completion to a client's ring. Returns 0, ESRCH if the alarm
+ * was submitted by an earlier owner of the ring (the completion is
+ * then discarded), or EAGAIN if the client is not keeping up (the
+ * completion is then counted in dropped).
+ */
+static inline int alarm_ring_complete(alarm_ring_t *ring, int client,
+                                      const alarm_ring_completion_t *done) {
+    alarm_ring_completions_t *completions = &ring->completions[client];
+    uint64_t tail;
+
+    if (!atomic_load(&completions->in_use)
+        || atomic_load(&completions->generation) != done->generation)
+        return ESRCH;
+
+    tail = atomic_load_explicit(&completions->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&completions->head, memory_order_acquire)
+        >= ALARM_RING_COMPLETIONS) {
+        atomic_fetch_add(&completions->dropped, 1);
+        return EAGAIN;
+    }
+    completions->entries[tail & (ALARM_RING_COMPLETIONS - 1)] = *done;
+    atomic_store(&completions->tail, tail + 1);
+    alarm_ring_ring(&completions->doorbell);
+    return 0;
+}
+
+/*
+ * Take the next completion from a client's ring. Returns 0, or EAGAIN
+ * if there is none. The caller must skip completions of another
+ * generation than its own (see alarm_ring_attach).
+ */
+static inline int alarm_ring_reap(alarm_ring_t *ring, int client,
+                                  alarm_ring_completion_t *done) {
+    alarm_ring_completions_t *completions = &ring->completions[client];
+    uint64_t head;
+
+    head = atomic_load_explicit(&completions->head, memory_order_relaxed);
+    if (head == atomic_load(&completions->tail))
+        return EAGAIN;
+    *done = completions->entries[head & (ALARM_RING_COMPLETIONS - 1)];
+    atomic_store_explicit(&completions->head, head + 1,
+                          memory_order_release);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+
+/*
+ * Lock-contention workload generator, grown out of
+ * 3.5.2.1-backoff.c. Instead of two threads and three mutexes, any
+ * number of threads each repeatedly acquire a set of locks out of a
+ * pool of M mutexes (using the same trylock backoff strategy), so
+ * that lock strategies can be compared at high thread counts.
+ *
+ * Usage: backoff-bench [-t threads] [-l locks] [-k locks-per-pass]
+ *                      [-p forward|reverse|mixed|random|hot]
+ *                      [-H hot-percent] [-d seconds] [-w work]
+ *                      [-b backoff] [-y yield] [-a]
+ */
+
+#define MAX_LOCKS 4096
+
+/*
+ * Acquisition patterns.
+ *
+ *   forward: every thread locks 0, 1, ..., k-1
+ *   reverse: every thread locks k-1, ..., 1, 0
+ *   mixed:   even threads lock forward, odd threads lock in reverse
+ *            (the scenario of 3.5.2.1-backoff.c)
+ *   random:  every pass locks k distinct random locks in random order
+ *   hot:     like random, but lock 0 is picked first with probability
+ *            hot_percent, so one lock is much more contended
+ */
+enum pattern {
+    PATTERN_FORWARD,
+    PATTERN_REVERSE,
+    PATTERN_MIXED,
+    PATTERN_RANDOM,
+    PATTERN_HOT
+};
+
+/*
+ * Per-thread state. Aligned to a cache line so that the counters of
+ * different threads do not share lines (which would itself add
+ * contention to what we are trying to measure).
+ */
+typedef struct {
+    pthread_t     thread;
+    int           id;
+    uint64_t      rng;
+    unsigned long acquisitions;
+    unsigned long backoffs;
+    int           order[MAX_LOCKS];
+    int           position[MAX_LOCKS]; // Of each lock in order.
+} __attribute__((aligned(64))) locker_t;
+
+pthread_mutex_t *mutex;
+
+int threads = 4;
+int locks = 3;
+int per_pass = 0;            /* 0 means "all locks" */
+enum pattern pattern = PATTERN_MIXED;
+int hot_percent = 50;
+int duration = 5;
+int work = 0;
+int pin = 0;
+
+/*
+ * Same meaning as in 3.5.2.1-backoff.c.
+ */
+int backoff = 1;
+int yieldFlag = 0;
+
+atomic_int stop = 0;
+atomic_int finished = 0;
+pthread_barrier_t start_barrier;
+
+/*
+ * xorshift64* generator. Each thread has its own state, so there is
+ * no shared state (as there is with rand()) to add contention.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Swap two entries of a random pass's lock order.
+ */
+static void swap_order(locker_t *self, int i, int j) {
+    int tmp = self->order[i];
+
+    self->order[i] = self->order[j];
+    self->order[j] = tmp;
+    self->position[self->order[i]] = i;
+    self->position[self->order[j]] = j;
+}
+
+/*
+ * Fill in the order in which this thread will lock mutexes on its
+ * next pass.
+ */
+static void choose_order(locker_t *self) {
+    int i, j;
+    int reverse;
+
+    switch (pattern) {
+    case PATTERN_FORWARD:
+    case PATTERN_REVERSE:
+    case PATTERN_MIXED:
+        reverse = pattern == PATTERN_REVERSE
+            || (pattern == PATTERN_MIXED && self->id % 2 == 1);
+        for (i = 0; i < per_pass; i++)
+            self->order[i] = reverse ? per_pass - 1 - i : i;
+        break;
+
+    case PATTERN_RANDOM:
+    case PATTERN_HOT:
+        /*
+         * Partial Fisher-Yates shuffle of the lock indexes gives k
+         * distinct locks in random order. Shuffling whatever order
+         * the last pass left is just as random as starting afresh,
+         * so only the first k entries are touched. For the hot
+         * pattern, lock 0 is swapped to the front first (with
+         * probability hot_percent).
+         */
+        i = 0;
+        if (pattern == PATTERN_HOT
+            && (int) (next_random(&self->rng) % 100) < hot_percent)
+            swap_order(self, i++, self->position[0]);
+        for ( ; i < per_pass; i++) {
+            j = i + next_random(&self->rng) % (locks - i);
+            swap_order(self, i, j);
+        }
+        break;
+    }
+}
+
+/*
+ * Lock every mutex in self->order, backing off (releasing everything
+ * held, in reverse order) whenever a trylock finds a mutex busy.
+ * Returns 1 with every mutex held, or 0 (holding none) if the stop
+ * flag was set while backing off.
+ */
+static int lock_all(locker_t *self) {
+    int status;
+    int j;
+
+    for (j = 0; j < per_pass; j++) {
+        if (j == 0 || !backoff)
+            status = pthread_mutex_lock(&mutex[self->order[j]]);
+        else
+            status = pthread_mutex_trylock(&mutex[self->order[j]]);
+
+        if (status == EBUSY) {
+            self->backoffs++;
+            for ( ; j > 0; j--) {
+                status = pthread_mutex_unlock(&mutex[self->order[j-1]]);
+                if (status != 0)
+                    err_abort(status, "Backoff");
+            }
+            /*
+             * Under heavy contention a thread may back off for a long
+             * time; give up once the run is over, rather than keep
+             * main waiting for a pass nobody will count.
+             */
+            if (atomic_load_explicit(&stop, memory_order_relaxed))
+                return 0;
+            /*
+             * Start over from the first mutex (the loop increment
+             * takes j back to 0).
+             */
+            j = -1;
+        } else if (status != 0) {
+            err_abort(status, "Lock mutex");
+        }
+
+        if (yieldFlag > 0)
+            sched_yield();
+        else if (yieldFlag < 0)
+            sleep(1);
+    }
+    return 1;
+}
+
+void *locker(void *arg) {
+    locker_t *self = (locker_t*) arg;
+    volatile int spin;
+    int status;
+    int k;
+
+    status = pthread_barrier_wait(&start_barrier);
+    if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+        err_abort(status, "Wait on start barrier");
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        choose_order(self);
+        if (!lock_all(self))
+            break;
+
+        // Simulated critical section.
+        for (spin = 0; spin < work; spin++)
+            ;
+
+        self->acquisitions++;
+
+        for (k = per_pass - 1; k >= 0; k--) {
+            status = pthread_mutex_unlock(&mutex[self->order[k]]);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+        }
+    }
+
+    atomic_fetch_add(&finished, 1);
+    return NULL;
+}
+
+static enum pattern parse_pattern(const char *name) {
+    if (strcmp(name, "forward") == 0)
+        return PATTERN_FORWARD;
+    if (strcmp(name, "reverse") == 0)
+        return PATTERN_REVERSE;
+    if (strcmp(name, "mixed") == 0)
+        return PATTERN_MIXED;
+    if (strcmp(name, "random") == 0)
+        return PATTERN_RANDOM;
+    if (strcmp(name, "hot") == 0)
+        return PATTERN_HOT;
+    fprintf(stderr, "Unknown pattern \"%s\"\n", name);
+    exit(1);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-l locks] [-k locks-per-pass]\n"
+            "          [-p forward|reverse|mixed|random|hot]"
+            " [-H hot-percent]\n"
+            "          [-d seconds] [-w work] [-b backoff]"
+            " [-y yield] [-a]\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    locker_t *locker_data;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    double start, elapsed;
+    unsigned long total_acquisitions = 0;
+    unsigned long total_backoffs = 0;
+    unsigned long min_acquisitions = (unsigned long) -1;
+    unsigned long max_acquisitions = 0;
+    double sum = 0, sum_squares = 0;
+    int ncpus;
+    int status;
+    int opt;
+    int i, j;
+
+    while ((opt = getopt(argc, argv, "t:l:k:p:H:d:w:b:y:a")) != -1) {
+        switch (opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'l': locks = atoi(optarg); break;
+        case 'k': per_pass = atoi(optarg); break;
+        case 'p': pattern = parse_pattern(optarg); break;
+        case 'H': hot_percent = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'w': work = atoi(optarg); break;
+        case 'b': backoff = atoi(optarg); break;
+        case 'y': yieldFlag = atoi(optarg); break;
+        case 'a': pin = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (threads < 1 || locks < 1 || locks > MAX_LOCKS || duration < 1)
+        usage(argv[0]);
+    if (per_pass <= 0 || per_pass > locks)
+        per_pass = locks;
+
+    mutex = malloc(locks * sizeof(pthread_mutex_t));
+    if (mutex == NULL)
+        errno_abort("Allocate mutexes");
+    for (i = 0; i < locks; i++) {
+        status = pthread_mutex_init(&mutex[i], NULL);
+        if (status != 0)
+            err_abort(status, "Init mutex");
+    }
+
+    /*
+     * posix_memalign rather than malloc, so that the cache line
+     * alignment of locker_t actually holds.
+     */
+    status = posix_memalign((void**) &locker_data, 64,
+                            threads * sizeof(locker_t));
+    if (status != 0)
+        err_abort(status, "Allocate lockers");
+    memset(locker_data, 0, threads * sizeof(locker_t));
+
+    status = pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    if (status != 0)
+        err_abort(status, "Init start barrier");
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+
+    for (i = 0; i < threads; i++) {
+        locker_data[i].id = i;
+        locker_data[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        for (j = 0; j < locks; j++) {
+            locker_data[i].order[j] = j;
+            locker_data[i].position[j] = j;
+        }
+
+        status = pthread_attr_init(&attr);
+        if (status != 0)
+            err_abort(status, "Init thread attributes");
+
+        // Pin thread i to CPU i (modulo the number of CPUs).
+        if (pin) {
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpus, &cpus);
+            status = pthread_attr_setaffinity_np(&attr, sizeof(cpus),
+                                                 &cpus);
+            if (status != 0)
+                err_abort(status, "Set thread affinity");
+        }
+
+        status = pthread_create(&locker_data[i].thread, &attr, locker,
+                                &locker_data[i]);
+        if (status != 0)
+            err_abort(status, "Create locker");
+
+        pthread_attr_destroy(&attr);
+    }
+
+    status = pthread_barrier_wait(&start_barrier);
+    if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+        err_abort(status, "Wait on start barrier");
+
+    start = now_seconds();
+    sleep(duration);
+    atomic_store(&stop, 1);
+    elapsed = now_seconds() - start;
+
+    /*
+     * Without backoff, the threads may well have deadlocked (which is
+     * the point of 3.5.2.1-backoff.c). Give them a second to notice
+     * the stop flag and, if they do not, report the deadlock rather
+     * than hanging in pthread_join. With backoff a deadlock is not
+     * possible, and every thread checks the stop flag while backing
+     * off, so just join them however long the last pass takes.
+     */
+    if (!backoff) {
+        for (i = 0; i < 100 && atomic_load(&finished) < threads; i++)
+            usleep(10000);
+
+        if (atomic_load(&finished) < threads) {
+            printf("Deadlock: %d of %d threads did not finish\n",
+                   threads - atomic_load(&finished), threads);
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < threads; i++) {
+        status = pthread_join(locker_data[i].thread, NULL);
+        if (status != 0)
+            err_abort(status, "Join locker");
+    }
+
+    printf("%-8s %14s %12s %14s\n",
+           "thread", "acquisitions", "backoffs", "backoffs/acq");
+    for (i = 0; i < threads; i++) {
+        locker_t *l = &locker_data[i];
+
+        printf("%-8d %14lu %12lu %14.3f\n",
+               i, l->acquisitions, l->backoffs,
+               l->acquisitions ? (double) l->backoffs / l->acquisitions
+                               : 0.0);
+
+        total_acquisitions += l->acquisitions;
+        total_backoffs += l->backoffs;
+        if (l->acquisitions < min_acquisitions)
+            min_acquisitions = l->acquisitions;
+        if (l->acquisitions > max_acquisitions)
+            max_acquisitions = l->acquisitions;
+        sum += l->acquisitions;
+        sum_squares += (double) l->acquisitions * l->acquisitions;
+    }
+
+    /*
+     * Fairness is reported as Jain's index, (sum x)^2 / (n * sum x^2),
+     * which is 1 when every thread got the same number of
+     * acquisitions and 1/n when one thread got all of them.
+     */
+    printf("\n");
+    printf("threads %d, locks %d, locks per pass %d, backoff %d\n",
+           threads, locks, per_pass, backoff);
+    printf("acquisitions/sec:        %.0f\n",
+           total_acquisitions / elapsed);
+    printf("backoffs/acquisition:    %.3f\n",
+           total_acquisitions
+               ? (double) total_backoffs / total_acquisitions : 0.0);
+    printf("per-thread min/max:      %lu / %lu\n",
+           min_acquisitions, max_acquisitions);
+    printf("fairness (Jain's index): %.3f\n",
+           sum_squares > 0 ? sum * sum / (threads * sum_squares) : 1.0);
+
+    return 0;
+}
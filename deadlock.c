@@ -1,6 +1,7 @@
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
+#include "lock_trace.h"
 
 pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
@@ -9,11 +10,16 @@ pthread_mutex_t mutex2 = PTHREAD_MUTEX_INITIALIZER;
  * thread_1 sleeps, then locks mutex 1, then sleeps again, then locks
  * mutex 2, then unlocks both mutexes. This is repeated indefinitely
  * (although this will cause a deadlock when run with thread_2).
+ *
+ * Run with LOCK_TRACE=file to trace the mutexes (see lock_trace.h),
+ * and stop the deadlocked program with ^C to write the trace.
  */
 void *thread_1(void *arg) {
     int status;
     int randomDuration;
 
+    lock_trace_thread("thread 1");
+
     while (1) {
         randomDuration = rand() % (5 + 1 - 2) + 2;
         printf("1: Sleeping for %d seconds\n", randomDuration);
@@ -21,7 +27,7 @@ void *thread_1(void *arg) {
 
         printf("1: about to lock mutex 1\n");
 
-        status = pthread_mutex_lock(&mutex1);
+        status = lock_trace_lock(&mutex1);
         if (status != 0)
             err_abort(status, "Thread 1 mutex 1");
 
@@ -33,7 +39,7 @@ void *thread_1(void *arg) {
 
         printf("1: about to lock mutex 2\n");
 
-        status = pthread_mutex_lock(&mutex2);
+        status = lock_trace_lock(&mutex2);
         if (status != 0)
             err_abort(status, "Thread 1 mutex 2");
 
@@ -41,7 +47,7 @@ void *thread_1(void *arg) {
 
         printf("1: about to unlock mutex 1\n");
 
-        status = pthread_mutex_unlock(&mutex1);
+        status = lock_trace_unlock(&mutex1);
         if (status != 0)
             err_abort(status, "Thread 1 mutex 1 unlock");
 
@@ -49,7 +55,7 @@ void *thread_1(void *arg) {
 
         printf("1: about to unlock mutex 2\n");
 
-        status = pthread_mutex_unlock(&mutex2);
+        status = lock_trace_unlock(&mutex2);
         if (status != 0)
             err_abort(status, "Thread 1 mutex 2 unlock");
 
@@ -70,6 +76,8 @@ void *thread_2(void *arg) {
     int status;
     int randomDuration;
 
+    lock_trace_thread("thread 2");
+
     while (1) {
         randomDuration = rand() % (5 + 1 - 2) + 2;
         printf("2: Sleeping for %d seconds\n", randomDuration);
@@ -77,7 +85,7 @@ void *thread_2(void *arg) {
 
         printf("2: about to lock mutex 2\n");
 
-        status = pthread_mutex_lock(&mutex2);
+        status = lock_trace_lock(&mutex2);
         if (status != 0)
             err_abort(status, "Thread 2 mutex 2");
 
@@ -89,7 +97,7 @@ void *thread_2(void *arg) {
 
         printf("2: about to lock mutex 1\n");
 
-        status = pthread_mutex_lock(&mutex1);
+        status = lock_trace_lock(&mutex1);
         if (status != 0)
             err_abort(status, "Thread 2 mutex 1");
 
@@ -97,7 +105,7 @@ void *thread_2(void *arg) {
 
         printf("2: about to unlock mutex 1\n");
 
-        status = pthread_mutex_unlock(&mutex1);
+        status = lock_trace_unlock(&mutex1);
         if (status != 0)
             err_abort(status, "Thread 2 mutex 1 unlock");
 
@@ -105,7 +113,7 @@ void *thread_2(void *arg) {
 
         printf("2: about to unlock mutex 2\n");
 
-        status = pthread_mutex_unlock(&mutex2);
+        status = lock_trace_unlock(&mutex2);
         if (status != 0)
             err_abort(status, "Thread 2 mutex 2 unlock");
 
@@ -122,6 +130,10 @@ int main(int argc, char *argv[]) {
     pthread_t thread_1_id;
     pthread_t thread_2_id;
 
+    lock_trace_init();
+    lock_trace_name(&mutex1, "mutex 1");
+    lock_trace_name(&mutex2, "mutex 2");
+
     status = pthread_create(
                             &thread_1_id,
                             NULL,
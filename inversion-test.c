@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "errors.h"
+
+/*
+ * Fire latency test for the -r and -P options of 3.3.4-alarm_cond.c,
+ * under priority inversion. Runs the scheduler (the command after the
+ * options) with every thread starting out in SCHED_IDLE, so that its
+ * main thread, which reads alarms from stdin and inserts them holding
+ * alarm_mutex, is a low-priority producer; -r then raises only the
+ * alarm-handling thread to SCHED_FIFO. Meanwhile, -b threads of this
+ * process keep the CPUs busy.
+ *
+ *   - The scheduler is first given -f far-off alarms, half due in an
+ *     hour and half in two, before the load starts.
+ *
+ *   - Then, every -i milliseconds for -d seconds, it is given a probe
+ *     alarm due in one second, and -m alarms due in 90 minutes. Those
+ *     land in the middle of the pending alarms, so with the array
+ *     engine the producer holds alarm_mutex for a long memmove each
+ *     time, and is likely to be preempted while holding it.
+ *
+ *   - Once every probe has fired, the scheduler's own statistics are
+ *     read, and the test fails (exit status 1) if its max fire latency
+ *     is over -l microseconds.
+ *
+ * For example, with the privileges that SCHED_FIFO needs:
+ *
+ *   ./inversion-test ./alarm_cond -r 20                 fails
+ *   ./inversion-test ./alarm_cond -r 20 -P              passes
+ *   ./inversion-test ./alarm_cond -r 20 -e skiplist     passes
+ *
+ * (the skip list engine inserts without holding alarm_mutex, so it has
+ * no inversion to suffer from).
+ *
+ * Usage: inversion-test [-b hogs] [-f filler] [-m middle] [-i ms]
+ *                       [-d seconds] [-l max-usec] scheduler [args]
+ */
+
+int hogs = 0;                 // 0 means one per CPU.
+long filler = 200000;
+int middle = 10;
+int interval = 100;
+int duration = 5;
+double limit = 50000;
+
+atomic_int stop = 0;
+
+/*
+ * What the scheduler has printed so far, as gathered by
+ * output_thread. Protected by output_mutex.
+ */
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
+int synced = 0;
+long probes_fired = 0;
+int have_stats = 0;
+int output_done = 0;
+unsigned long stats_fired;
+double stats_mean, stats_p50, stats_p99, stats_max;
+
+FILE *scheduler_in;
+FILE *scheduler_out;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *hog_thread(void *arg) {
+    while (!atomic_load_explicit(&stop, memory_order_relaxed))
+        ;
+    return NULL;
+}
+
+/*
+ * Read what the scheduler prints: the alarms that fire, and the
+ * statistics it prints at the end of its input. Its "Alarm > " prompts
+ * have no newline, so what we look for may be anywhere in a line.
+ */
+void *output_thread(void *arg) {
+    char *line = NULL;
+    size_t line_size = 0;
+    char *stats;
+
+    // Once the scheduler exits, this ends with EIO rather than EOF.
+    while (getline(&line, &line_size, scheduler_out) != -1) {
+        pthread_mutex_lock(&output_mutex);
+        if (strstr(line, "(0) sync") != NULL)
+            synced = 1;
+        if (strstr(line, "(1) probe") != NULL)
+            probes_fired++;
+        stats = strstr(line, "Fired ");
+        if (stats != NULL
+            && sscanf(stats, "Fired %lu alarms, latency (usec): mean %lf,"
+                      " p50 <= %lf, p99 <= %lf, max %lf",
+                      &stats_fired, &stats_mean, &stats_p50, &stats_p99,
+                      &stats_max) == 5)
+            have_stats = 1;
+        pthread_cond_broadcast(&output_cond);
+        pthread_mutex_unlock(&output_mutex);
+    }
+
+    pthread_mutex_lock(&output_mutex);
+    output_done = 1;
+    pthread_cond_broadcast(&output_cond);
+    pthread_mutex_unlock(&output_mutex);
+    free(line);
+    return NULL;
+}
+
+/*
+ * Start the scheduler with its threads in SCHED_IDLE, writing to it
+ * through a pipe. It reads back through a pseudo-terminal, so that
+ * the scheduler's stdout is line buffered and each alarm is seen as
+ * it fires.
+ */
+static pid_t scheduler_start(char *argv[]) {
+    struct sched_param param;
+    int in[2], terminal, out;
+    pid_t pid;
+
+    if (pipe(in) == -1)
+        errno_abort("Create pipe");
+    terminal = posix_openpt(O_RDWR | O_NOCTTY);
+    if (terminal == -1 || grantpt(terminal) == -1
+        || unlockpt(terminal) == -1)
+        errno_abort("Create pseudo-terminal");
+
+    pid = fork();
+    if (pid == -1)
+        errno_abort("Fork scheduler");
+    if (pid == 0) {
+        param.sched_priority = 0;
+        if (sched_setscheduler(0, SCHED_IDLE, &param) == -1)
+            errno_abort("Set SCHED_IDLE");
+        out = open(ptsname(terminal), O_WRONLY | O_NOCTTY);
+        if (out == -1)
+            errno_abort("Open pseudo-terminal");
+        dup2(in[0], STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out);
+        close(terminal);
+        execvp(argv[0], argv);
+        errno_abort("Run scheduler");
+    }
+
+    close(in[0]);
+    scheduler_in = fdopen(in[1], "w");
+    scheduler_out = fdopen(terminal, "r");
+    if (scheduler_in == NULL || scheduler_out == NULL)
+        errno_abort("Open scheduler streams");
+    return pid;
+}
+
+/*
+ * Wait (for at most the given number of seconds) until the scheduler
+ * has printed enough for *condition to be true. Returns whether it is.
+ * Called with output_mutex held.
+ */
+static int output_wait(int *condition, int seconds) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    while (!*condition && !output_done) {
+        if (pthread_cond_timedwait(&output_cond, &output_mutex,
+                                   &deadline) == ETIMEDOUT)
+            break;
+    }
+    return *condition;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-b hogs] [-f filler] [-m middle] [-i ms]\n"
+            "          [-d seconds] [-l max-usec] scheduler [args]\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t *hog_threads;
+    pthread_t reader;
+    struct timespec deadline;
+    pid_t pid;
+    double end, next;
+    long probes = 0;
+    long i;
+    int all_fired;
+    int status;
+    int opt;
+
+    // "+" stops at the scheduler command, leaving its options alone.
+    while ((opt = getopt(argc, argv, "+b:f:m:i:d:l:")) != -1) {
+        switch (opt) {
+        case 'b': hogs = atoi(optarg); break;
+        case 'f': filler = atol(optarg); break;
+        case 'm': middle = atoi(optarg); break;
+        case 'i': interval = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'l': limit = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || hogs < 0 || filler < 0 || middle < 0
+        || interval < 1 || duration < 1 || limit <= 0)
+        usage(argv[0]);
+    if (hogs == 0)
+        hogs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (hogs < 1)
+        hogs = 1;
+
+    pid = scheduler_start(&argv[optind]);
+    status = pthread_create(&reader, NULL, output_thread, NULL);
+    if (status != 0)
+        err_abort(status, "Create output thread");
+
+    /*
+     * Fill the scheduler up before the load starts (a SCHED_IDLE
+     * producer would take forever to do it afterwards), and wait for
+     * an alarm due at once to show that it has got through them.
+     */
+    for (i = 0; i < filler; i++)
+        fprintf(scheduler_in, "%d filler\n", i < filler / 2 ? 3600 : 7200);
+    fprintf(scheduler_in, "0 sync\n");
+    fflush(scheduler_in);
+    pthread_mutex_lock(&output_mutex);
+    if (!output_wait(&synced, 60)) {
+        fprintf(stderr, "The scheduler did not take the filler alarms\n");
+        exit(1);
+    }
+    pthread_mutex_unlock(&output_mutex);
+
+    hog_threads = malloc(hogs * sizeof(pthread_t));
+    if (hog_threads == NULL)
+        errno_abort("Allocate hogs");
+    for (i = 0; i < hogs; i++) {
+        status = pthread_create(&hog_threads[i], NULL, hog_thread, NULL);
+        if (status != 0)
+            err_abort(status, "Create hog");
+    }
+
+    end = now_seconds() + duration;
+    for (next = now_seconds(); next < end; next += interval / 1e3) {
+        fprintf(scheduler_in, "1 probe\n");
+        for (i = 0; i < middle; i++)
+            fprintf(scheduler_in, "5400 middle\n");
+        fflush(scheduler_in);
+        probes++;
+        while (now_seconds() < next + interval / 1e3)
+            usleep(1000);
+    }
+
+    /*
+     * Without the hogs, the producer soon catches up with whatever it
+     * has not read yet. Only end its input once every probe has fired,
+     * since it prints its statistics then.
+     */
+    atomic_store(&stop, 1);
+    for (i = 0; i < hogs; i++)
+        pthread_join(hog_threads[i], NULL);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 60;
+    pthread_mutex_lock(&output_mutex);
+    while (!output_done && probes_fired < probes) {
+        if (pthread_cond_timedwait(&output_cond, &output_mutex,
+                                   &deadline) == ETIMEDOUT)
+            break;
+    }
+    all_fired = probes_fired == probes;
+    pthread_mutex_unlock(&output_mutex);
+
+    fclose(scheduler_in);
+    pthread_join(reader, NULL);
+    waitpid(pid, &status, 0);
+
+    if (!have_stats) {
+        fprintf(stderr, "The scheduler printed no latency statistics\n");
+        return 1;
+    }
+    printf("%ld probes, %ld fired; fire latency (usec): mean %.1f,"
+           " p99 <= %.1f, max %.1f (limit %.1f)\n",
+           probes, probes_fired, stats_mean, stats_p99, stats_max, limit);
+    if (!all_fired || stats_max > limit) {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
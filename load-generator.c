@@ -0,0 +1,407 @@
+#include <pthread.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+
+/*
+ * Load generator for the alarm programs (1.5.3-alarm_thread.c and
+ * 3.3.4-alarm_cond.c). This started out as a test of how to sleep
+ * for a random amount of time; it now has several producer threads
+ * write alarm commands ("<seconds> <message>") to stdout, with
+ * arrivals following a chosen distribution, e.g.
+ *
+ *     ./load-generator -p 4 -r 2000 -a poisson | ./alarm_cond
+ *
+ * Arrivals (-a):
+ *   poisson: exponentially distributed gaps (the default)
+ *   bursty:  bursts of -b alarms back to back, the bursts themselves
+ *            arriving as a Poisson process
+ *   uniform: gaps uniformly distributed between 0 and twice the mean
+ *   trace:   replay the file given with -t, where each line is
+ *            "<offset-ms> <seconds> <message>"
+ *
+ * Deadlines (-D):
+ *   const:N         always N seconds
+ *   uniform:MIN:MAX uniformly distributed between MIN and MAX seconds
+ *                   (the default is uniform:5:10)
+ *   exp:MEAN        exponentially distributed with the given mean
+ *
+ * Needs -lm (as well as -pthread) to compile.
+ */
+
+enum arrival {
+    ARRIVAL_POISSON,
+    ARRIVAL_BURSTY,
+    ARRIVAL_UNIFORM,
+    ARRIVAL_TRACE
+};
+
+enum deadline {
+    DEADLINE_CONST,
+    DEADLINE_UNIFORM,
+    DEADLINE_EXP
+};
+
+/*
+ * One line of a replayed trace.
+ */
+typedef struct {
+    int64_t offset;   // Nanoseconds after the start of the run.
+    char   *command;  // "<seconds> <message>\n"
+} trace_entry_t;
+
+/*
+ * Per-producer state. Each producer has its own random number
+ * generator state, instead of all of them sharing (and contending
+ * on) the hidden global state of rand().
+ */
+typedef struct {
+    pthread_t     thread;
+    int           id;
+    uint64_t      rng;
+    unsigned long emitted;
+} producer_t;
+
+int producers = 1;
+double rate = 10;             // Alarms per second, over all producers.
+int burst = 10;
+long count = 0;               // Alarms per producer; 0 means no limit.
+int duration = -1;            // Seconds; 0 means no limit.
+enum arrival arrival = ARRIVAL_POISSON;
+enum deadline deadline = DEADLINE_UNIFORM;
+double deadline_a = 5;
+double deadline_b = 10;
+
+trace_entry_t *trace = NULL;
+size_t trace_length = 0;
+
+int64_t start_time;
+
+/*
+ * splitmix64, used to turn a single seed into well separated
+ * per-producer seeds.
+ */
+static uint64_t splitmix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * xorshift64* generator.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Uniformly distributed double in (0, 1].
+ */
+static double next_uniform(uint64_t *state) {
+    return ((next_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Exponentially distributed double with the given mean.
+ */
+static double next_exponential(uint64_t *state, double mean) {
+    return -log(next_uniform(state)) * mean;
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Sleep until the given time (in nanoseconds on CLOCK_MONOTONIC).
+ * Sleeping until an absolute time, rather than for a relative gap,
+ * keeps the time spent writing from adding up and lowering the rate.
+ */
+static void sleep_until(int64_t when) {
+    struct timespec ts;
+    int status;
+
+    ts.tv_sec = when / 1000000000;
+    ts.tv_nsec = when % 1000000000;
+    do {
+        status = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    } while (status == EINTR);
+    if (status != 0)
+        err_abort(status, "Sleep");
+}
+
+/*
+ * Write one command to stdout. A single write() of at most PIPE_BUF
+ * bytes is atomic, so lines from different producers are never
+ * interleaved, and there is no stdio lock to contend on. (Generated
+ * commands are far shorter than that, and load_trace refuses longer
+ * trace lines.)
+ */
+static void emit(const char *command, size_t length) {
+    if (write(STDOUT_FILENO, command, length) != (ssize_t) length)
+        errno_abort("Write command");
+}
+
+static int next_deadline(uint64_t *state) {
+    double seconds = 0;
+
+    switch (deadline) {
+    case DEADLINE_CONST:
+        seconds = deadline_a;
+        break;
+    case DEADLINE_UNIFORM:
+        seconds = deadline_a
+            + next_uniform(state) * (deadline_b - deadline_a);
+        break;
+    case DEADLINE_EXP:
+        seconds = next_exponential(state, deadline_a);
+        break;
+    }
+    return (int) (seconds + 0.5);
+}
+
+/*
+ * Whether a producer that has emitted the given number of alarms
+ * should keep going.
+ */
+static int keep_going(unsigned long emitted, int64_t when) {
+    if (count > 0 && emitted >= (unsigned long) count)
+        return 0;
+    if (duration > 0 && when - start_time >= (int64_t) duration * 1000000000)
+        return 0;
+    return 1;
+}
+
+void *producer_thread(void *arg) {
+    producer_t *self = (producer_t*) arg;
+    char command[128];
+    double mean_gap;
+    int64_t when = start_time;
+    size_t i;
+    int in_burst;
+    int length;
+
+    if (arrival == ARRIVAL_TRACE) {
+        // Producer i replays every producers'th line of the trace.
+        for (i = self->id; i < trace_length; i += producers) {
+            if (!keep_going(self->emitted, start_time + trace[i].offset))
+                break;
+            sleep_until(start_time + trace[i].offset);
+            emit(trace[i].command, strlen(trace[i].command));
+            self->emitted++;
+        }
+        return NULL;
+    }
+
+    // Mean gap between arrivals (or bursts) of this producer, in ns.
+    mean_gap = 1e9 * producers / rate;
+    if (arrival == ARRIVAL_BURSTY)
+        mean_gap *= burst;
+
+    while (1) {
+        switch (arrival) {
+        case ARRIVAL_POISSON:
+        case ARRIVAL_BURSTY:
+            when += (int64_t) next_exponential(&self->rng, mean_gap);
+            break;
+        case ARRIVAL_UNIFORM:
+            when += (int64_t) (next_uniform(&self->rng) * 2 * mean_gap);
+            break;
+        case ARRIVAL_TRACE:
+            break;
+        }
+
+        if (!keep_going(self->emitted, when))
+            break;
+        sleep_until(when);
+
+        for (in_burst = arrival == ARRIVAL_BURSTY ? burst : 1;
+             in_burst > 0 && keep_going(self->emitted, when);
+             in_burst--) {
+            length = snprintf(command, sizeof(command), "%d p%d-%lu\n",
+                              next_deadline(&self->rng),
+                              self->id,
+                              self->emitted);
+            emit(command, length);
+            self->emitted++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read a trace file into trace, sorted by offset.
+ */
+static int compare_trace(const void *a, const void *b) {
+    const trace_entry_t *x = a, *y = b;
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static void load_trace(const char *path) {
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t capacity = 0;
+    double offset_ms;
+    int offset;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        errno_abort("Open trace");
+
+    while (getline(&line, &line_size, file) != -1) {
+        offset = 0;
+        if (sscanf(line, "%lf %n", &offset_ms, &offset) < 1 || offset == 0
+            || line[offset] == '\0' || line[offset] == '\n') {
+            fprintf(stderr, "Bad trace line: %s", line);
+            continue;
+        }
+        if (strlen(line + offset) > PIPE_BUF) {
+            fprintf(stderr, "Trace line over %d bytes: %.40s...\n",
+                    PIPE_BUF, line);
+            continue;
+        }
+
+        if (trace_length == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            trace = realloc(trace, capacity * sizeof(trace_entry_t));
+            if (trace == NULL)
+                errno_abort("Grow trace");
+        }
+        trace[trace_length].offset = (int64_t) (offset_ms * 1e6);
+        trace[trace_length].command = strdup(line + offset);
+        if (trace[trace_length].command == NULL)
+            errno_abort("Copy trace line");
+        trace_length++;
+    }
+
+    free(line);
+    fclose(file);
+    qsort(trace, trace_length, sizeof(trace_entry_t), compare_trace);
+}
+
+static void parse_deadline(char *spec) {
+    if (sscanf(spec, "const:%lf", &deadline_a) == 1) {
+        deadline = DEADLINE_CONST;
+    } else if (sscanf(spec, "uniform:%lf:%lf",
+                      &deadline_a, &deadline_b) == 2) {
+        deadline = DEADLINE_UNIFORM;
+    } else if (sscanf(spec, "exp:%lf", &deadline_a) == 1) {
+        deadline = DEADLINE_EXP;
+    } else {
+        fprintf(stderr, "Bad deadline distribution \"%s\"\n", spec);
+        exit(1);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-p producers] [-r rate] [-a poisson|bursty|uniform"
+            "|trace]\n"
+            "          [-b burst] [-t trace-file] [-D deadlines]"
+            " [-n count] [-d seconds]\n"
+            "          [-s seed]\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    producer_t *producer_data;
+    const char *trace_path = NULL;
+    uint64_t seed = time(NULL);
+    unsigned long total = 0;
+    double elapsed;
+    int status;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "p:r:a:b:t:D:n:d:s:")) != -1) {
+        switch (opt) {
+        case 'p': producers = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'b': burst = atoi(optarg); break;
+        case 't': trace_path = optarg; break;
+        case 'D': parse_deadline(optarg); break;
+        case 'n': count = atol(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'a':
+            if (strcmp(optarg, "poisson") == 0)
+                arrival = ARRIVAL_POISSON;
+            else if (strcmp(optarg, "bursty") == 0)
+                arrival = ARRIVAL_BURSTY;
+            else if (strcmp(optarg, "uniform") == 0)
+                arrival = ARRIVAL_UNIFORM;
+            else if (strcmp(optarg, "trace") == 0)
+                arrival = ARRIVAL_TRACE;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (producers < 1 || rate <= 0 || burst < 1)
+        usage(argv[0]);
+
+    if (arrival == ARRIVAL_TRACE) {
+        if (trace_path == NULL)
+            usage(argv[0]);
+        load_trace(trace_path);
+    }
+
+    /*
+     * Unless told otherwise, generated load runs for 10 seconds (or,
+     * with -n, until each producer has emitted its count) and a trace
+     * is replayed to the end.
+     */
+    if (duration < 0)
+        duration = arrival == ARRIVAL_TRACE || count > 0 ? 0 : 10;
+
+    producer_data = calloc(producers, sizeof(producer_t));
+    if (producer_data == NULL)
+        errno_abort("Allocate producers");
+
+    start_time = now_ns();
+
+    for (i = 0; i < producers; i++) {
+        producer_data[i].id = i;
+        producer_data[i].rng = splitmix(seed + i);
+        // xorshift must not start from 0.
+        if (producer_data[i].rng == 0)
+            producer_data[i].rng = 1;
+
+        status = pthread_create(&producer_data[i].thread, NULL,
+                                producer_thread, &producer_data[i]);
+        if (status != 0)
+            err_abort(status, "Create producer");
+    }
+
+    for (i = 0; i < producers; i++) {
+        status = pthread_join(producer_data[i].thread, NULL);
+        if (status != 0)
+            err_abort(status, "Join producer");
+        total += producer_data[i].emitted;
+    }
+
+    elapsed = (now_ns() - start_time) / 1e9;
+    fprintf(stderr, "Emitted %lu alarms in %.2f seconds (%.1f/sec)\n",
+            total, elapsed, elapsed > 0 ? total / elapsed : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,410 @@
+#ifndef __lock_trace_h
+#define __lock_trace_h
+
+/*
+ * Mutex event tracer, used by deadlock.c and 3.5.2.1-backoff.c.
+ *
+ * Lock and unlock mutexes through lock_trace_lock, lock_trace_trylock
+ * and lock_trace_unlock, and each thread records what it does into a
+ * buffer of its own (so recording takes no locks and shares no cache
+ * lines): when it started trying for a mutex, when it got it, when it
+ * released it, and when a trylock found it busy and the thread backed
+ * off. Timestamps are read from the TSC on x86 (and scaled to
+ * CLOCK_MONOTONIC when the trace is written), or from CLOCK_MONOTONIC
+ * elsewhere.
+ *
+ * Tracing is off unless the LOCK_TRACE environment variable names a
+ * file, e.g.
+ *
+ *     LOCK_TRACE=trace.json ./deadlock
+ *
+ * The trace is written when the program exits, or when it gets SIGINT
+ * or SIGTERM (so a deadlocked run can be stopped with ^C), as Chrome
+ * trace-event JSON, which chrome://tracing and ui.perfetto.dev can
+ * show:
+ *
+ *   - "wait <mutex>" slices, from trying for a mutex to getting it,
+ *   - "hold <mutex>" async slices, from getting a mutex to releasing
+ *     it (async, since a thread need not release mutexes in the
+ *     reverse of the order it locked them),
+ *   - "backoff <mutex>" instants.
+ *
+ * Slices still open when the trace is written (such as the waits of a
+ * deadlock) end at that point, and are marked "unfinished".
+ *
+ * Each thread keeps its last LOCK_TRACE_EVENTS events.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "errors.h"
+
+#define LOCK_TRACE_EVENTS 65536   // Per thread; must be a power of two.
+#define LOCK_TRACE_NAMES  64
+
+typedef enum {
+    LOCK_TRACE_ATTEMPT,
+    LOCK_TRACE_ACQUIRE,
+    LOCK_TRACE_RELEASE,
+    LOCK_TRACE_BACKOFF
+} lock_trace_kind_t;
+
+typedef struct {
+    uint64_t          time;
+    pthread_mutex_t  *mutex;
+    lock_trace_kind_t kind;
+} lock_trace_event_t;
+
+typedef struct lock_trace_buffer {
+    struct lock_trace_buffer *next;
+    int                       id;
+    const char               *name;
+    _Atomic uint64_t          count;   // Events ever recorded.
+    lock_trace_event_t        events[LOCK_TRACE_EVENTS];
+} lock_trace_buffer_t;
+
+static struct {
+    const char                   *path;
+    _Atomic int                   enabled;
+    _Atomic int                   threads;
+    _Atomic(lock_trace_buffer_t*) buffers;
+    uint64_t                      start_ticks;
+    int64_t                       start_ns;
+    pthread_mutex_t               names_mutex;
+    int                           name_count;
+    pthread_mutex_t              *mutexes[LOCK_TRACE_NAMES];
+    const char                   *names[LOCK_TRACE_NAMES];
+} lock_trace = { .names_mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread lock_trace_buffer_t *lock_trace_self = NULL;
+static __thread const char *lock_trace_self_name = NULL;
+
+static inline int64_t lock_trace_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t lock_trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return lock_trace_ns();
+#endif
+}
+
+/*
+ * Give this thread's buffer to the tracer, the first time the thread
+ * records an event.
+ */
+static inline lock_trace_buffer_t *lock_trace_buffer(void) {
+    lock_trace_buffer_t *buffer;
+
+    buffer = calloc(1, sizeof(lock_trace_buffer_t));
+    if (buffer == NULL)
+        errno_abort("Allocate lock trace buffer");
+    buffer->id = atomic_fetch_add(&lock_trace.threads, 1) + 1;
+    buffer->name = lock_trace_self_name;
+    buffer->next = atomic_load(&lock_trace.buffers);
+    while (!atomic_compare_exchange_weak(&lock_trace.buffers,
+                                         &buffer->next, buffer))
+        ;
+    lock_trace_self = buffer;
+    return buffer;
+}
+
+static inline void lock_trace_record(pthread_mutex_t *mutex,
+                                     lock_trace_kind_t kind) {
+    lock_trace_buffer_t *buffer = lock_trace_self;
+    lock_trace_event_t *event;
+    uint64_t count;
+
+    if (!atomic_load_explicit(&lock_trace.enabled, memory_order_relaxed))
+        return;
+    if (buffer == NULL)
+        buffer = lock_trace_buffer();
+
+    count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    event = &buffer->events[count & (LOCK_TRACE_EVENTS - 1)];
+    event->time = lock_trace_ticks();
+    event->mutex = mutex;
+    event->kind = kind;
+    atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+/*
+ * Name this thread, or a mutex, in the trace (otherwise threads are
+ * numbered, and mutexes shown by address).
+ */
+static inline void lock_trace_thread(const char *name) {
+    lock_trace_self_name = name;
+    if (lock_trace_self != NULL)
+        lock_trace_self->name = name;
+}
+
+static inline void lock_trace_name(pthread_mutex_t *mutex, const char *name) {
+    pthread_mutex_lock(&lock_trace.names_mutex);
+    if (lock_trace.name_count < LOCK_TRACE_NAMES) {
+        lock_trace.mutexes[lock_trace.name_count] = mutex;
+        lock_trace.names[lock_trace.name_count] = name;
+        lock_trace.name_count++;
+    }
+    pthread_mutex_unlock(&lock_trace.names_mutex);
+}
+
+static inline int lock_trace_lock(pthread_mutex_t *mutex) {
+    int status;
+
+    lock_trace_record(mutex, LOCK_TRACE_ATTEMPT);
+    status = pthread_mutex_lock(mutex);
+    if (status == 0)
+        lock_trace_record(mutex, LOCK_TRACE_ACQUIRE);
+    return status;
+}
+
+/*
+ * Trylock; finding the mutex busy is recorded as a backoff.
+ */
+static inline int lock_trace_trylock(pthread_mutex_t *mutex) {
+    int status;
+
+    lock_trace_record(mutex, LOCK_TRACE_ATTEMPT);
+    status = pthread_mutex_trylock(mutex);
+    if (status == 0)
+        lock_trace_record(mutex, LOCK_TRACE_ACQUIRE);
+    else if (status == EBUSY)
+        lock_trace_record(mutex, LOCK_TRACE_BACKOFF);
+    return status;
+}
+
+static inline int lock_trace_unlock(pthread_mutex_t *mutex) {
+    // Record first, so the release never appears after the next acquire.
+    lock_trace_record(mutex, LOCK_TRACE_RELEASE);
+    return pthread_mutex_unlock(mutex);
+}
+
+/*
+ * Write one mutex's name (or address) into the trace.
+ */
+static inline void lock_trace_write_name(FILE *file, pthread_mutex_t *mutex) {
+    int i;
+
+    for (i = 0; i < lock_trace.name_count; i++) {
+        if (lock_trace.mutexes[i] == mutex) {
+            fputs(lock_trace.names[i], file);
+            return;
+        }
+    }
+    fprintf(file, "%p", (void*) mutex);
+}
+
+/*
+ * Open wait and hold of one mutex, while writing a thread's events.
+ */
+typedef struct {
+    pthread_mutex_t *mutex;
+    double           attempt;   // In microseconds, or -1 if none.
+    double           acquire;
+} lock_trace_open_t;
+
+static inline void lock_trace_write_event(FILE *file, int *first,
+                                          const char *phase,
+                                          const char *what,
+                                          pthread_mutex_t *mutex,
+                                          int tid, double time,
+                                          double duration, int unfinished) {
+    fprintf(file, "%s\n{\"name\":\"%s ", *first ? "" : ",", what);
+    lock_trace_write_name(file, mutex);
+    fprintf(file, "\",\"cat\":\"lock\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%.3f", phase, (int) getpid(), tid, time);
+    if (duration >= 0)
+        fprintf(file, ",\"dur\":%.3f", duration);
+    if (phase[0] == 'b' || phase[0] == 'e')
+        fprintf(file, ",\"id\":\"%d:%p\"", tid, (void*) mutex);
+    if (phase[0] == 'i')
+        fprintf(file, ",\"s\":\"t\"");
+    if (unfinished)
+        fprintf(file, ",\"args\":{\"unfinished\":true}");
+    fprintf(file, "}");
+    *first = 0;
+}
+
+/*
+ * Write the trace to the file named by LOCK_TRACE. Called once, at
+ * exit; recording is turned off first, so any thread still running
+ * stops adding to its buffer.
+ */
+static inline void lock_trace_write(void) {
+    lock_trace_buffer_t *buffer;
+    lock_trace_event_t *event;
+    lock_trace_open_t open[LOCK_TRACE_NAMES];
+    uint64_t end_ticks;
+    int64_t end_ns;
+    double scale;
+    double time;
+    double end;
+    uint64_t count, i;
+    int open_count;
+    int first = 1;
+    int j;
+    FILE *file;
+
+    if (!atomic_exchange(&lock_trace.enabled, 0))
+        return;
+
+    end_ticks = lock_trace_ticks();
+    end_ns = lock_trace_ns();
+    // Microseconds per tick.
+    scale = end_ticks > lock_trace.start_ticks
+        ? (double) (end_ns - lock_trace.start_ns)
+          / (end_ticks - lock_trace.start_ticks) / 1e3
+        : 0;
+    end = (end_ticks - lock_trace.start_ticks) * scale;
+
+    file = fopen(lock_trace.path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot write %s: %s\n",
+                lock_trace.path, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (buffer = atomic_load(&lock_trace.buffers);
+         buffer != NULL;
+         buffer = buffer->next) {
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+                first ? "" : ",", (int) getpid(), buffer->id);
+        if (buffer->name != NULL)
+            fputs(buffer->name, file);
+        else
+            fprintf(file, "thread %d", buffer->id);
+        fprintf(file, "\"}}");
+        first = 0;
+
+        open_count = 0;
+        count = atomic_load(&buffer->count);
+        i = count > LOCK_TRACE_EVENTS ? count - LOCK_TRACE_EVENTS : 0;
+        for ( ; i < count; i++) {
+            event = &buffer->events[i & (LOCK_TRACE_EVENTS - 1)];
+            time = (int64_t) (event->time - lock_trace.start_ticks) * scale;
+
+            for (j = 0; j < open_count; j++) {
+                if (open[j].mutex == event->mutex)
+                    break;
+            }
+            if (j == open_count) {
+                if (open_count == LOCK_TRACE_NAMES)
+                    continue;
+                open[j].mutex = event->mutex;
+                open[j].attempt = -1;
+                open[j].acquire = -1;
+                open_count++;
+            }
+
+            switch (event->kind) {
+            case LOCK_TRACE_ATTEMPT:
+                open[j].attempt = time;
+                break;
+            case LOCK_TRACE_ACQUIRE:
+                if (open[j].attempt >= 0)
+                    lock_trace_write_event(file, &first, "X", "wait",
+                                           event->mutex, buffer->id,
+                                           open[j].attempt,
+                                           time - open[j].attempt, 0);
+                open[j].attempt = -1;
+                open[j].acquire = time;
+                lock_trace_write_event(file, &first, "b", "hold",
+                                       event->mutex, buffer->id,
+                                       time, -1, 0);
+                break;
+            case LOCK_TRACE_BACKOFF:
+                open[j].attempt = -1;
+                lock_trace_write_event(file, &first, "i", "backoff",
+                                       event->mutex, buffer->id,
+                                       time, -1, 0);
+                break;
+            case LOCK_TRACE_RELEASE:
+                // The acquire may have been overwritten.
+                if (open[j].acquire >= 0)
+                    lock_trace_write_event(file, &first, "e", "hold",
+                                           event->mutex, buffer->id,
+                                           time, -1, 0);
+                open[j].acquire = -1;
+                break;
+            }
+        }
+
+        // Close whatever is still going on.
+        for (j = 0; j < open_count; j++) {
+            if (open[j].attempt >= 0)
+                lock_trace_write_event(file, &first, "X", "wait",
+                                       open[j].mutex, buffer->id,
+                                       open[j].attempt,
+                                       end - open[j].attempt, 1);
+            if (open[j].acquire >= 0)
+                lock_trace_write_event(file, &first, "e", "hold",
+                                       open[j].mutex, buffer->id,
+                                       end, -1, 1);
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    fprintf(stderr, "Lock trace written to %s\n", lock_trace.path);
+}
+
+/*
+ * Wait for SIGINT or SIGTERM (blocked in every thread by
+ * lock_trace_init), and exit, which writes the trace.
+ */
+static inline void *lock_trace_signal_thread(void *arg) {
+    sigset_t *signals = arg;
+    int signal_number;
+
+    if (sigwait(signals, &signal_number) != 0)
+        return NULL;
+    exit(128 + signal_number);
+}
+
+/*
+ * Start tracing, if LOCK_TRACE is set. Call from main before creating
+ * any other thread, so that they inherit the blocked signals. The
+ * thread that waits for the signals never exits, so main must end by
+ * returning (or calling exit), not with pthread_exit.
+ */
+static inline void lock_trace_init(void) {
+    static sigset_t signals;
+    pthread_t thread;
+    int status;
+
+    lock_trace.path = getenv("LOCK_TRACE");
+    if (lock_trace.path == NULL || lock_trace.path[0] == '\0')
+        return;
+
+    lock_trace.start_ticks = lock_trace_ticks();
+    lock_trace.start_ns = lock_trace_ns();
+    atomic_store(&lock_trace.enabled, 1);
+    atexit(lock_trace_write);
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    status = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (status != 0)
+        err_abort(status, "Block signals");
+    status = pthread_create(&thread, NULL, lock_trace_signal_thread, &signals);
+    if (status != 0)
+        err_abort(status, "Create lock trace signal thread");
+    pthread_detach(thread);
+}
+
+#endif
@@ -0,0 +1,395 @@
+#ifndef __skiplist_h
+#define __skiplist_h
+
+/*
+ * Concurrent skip list, keyed by a 64-bit time, used as a storage
+ * engine by 3.3.4-alarm_cond.c (-e skiplist).
+ *
+ *   - Inserts are lock-free, so any number of threads can insert at
+ *     once (the lock-free skip list of Herlihy and Shavit, with
+ *     deleted nodes marked in the low bit of their next pointers).
+ *
+ *   - Ordered scans (skiplist_range) are lock-free, read-only, and
+ *     never hold up writers.
+ *
+ *   - Removals (skiplist_remove) must be serialized by the caller
+ *     (the scheduler holds alarm_mutex for them), but run
+ *     concurrently with inserts and scans.
+ *
+ *   - Removed nodes are freed with epoch-based reclamation: a node is
+ *     only freed once every thread that was inside the list when it
+ *     was removed has left.
+ *
+ * Each node carries an opaque payload of a size chosen when it is
+ * created, placed after its tower of next pointers (so it is 8-byte
+ * aligned).
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "errors.h"
+
+#define SKIPLIST_MAX_LEVEL   24
+#define SKIPLIST_MAX_THREADS 64
+
+typedef struct skiplist_node {
+    int64_t           key;
+    uint64_t          sequence;   // Insertion order, to break ties.
+    int32_t           value;
+    uint32_t          level;      // Height of the tower.
+    size_t            size;       // Of the whole node, for accounting.
+    struct skiplist_node *retired;
+    _Atomic uintptr_t next[];     // Low bit set means "removed".
+} skiplist_node_t;
+
+/*
+ * Per-thread epoch announcement, on its own cache line.
+ */
+typedef struct {
+    _Atomic uint64_t epoch;
+    _Atomic int      active;
+} __attribute__((aligned(64))) skiplist_reader_t;
+
+typedef struct {
+    skiplist_node_t   *head;
+    _Atomic uint64_t   sequence;
+    _Atomic size_t     count;
+    _Atomic size_t     bytes;
+    _Atomic uint64_t   epoch;
+    _Atomic int        readers_used;
+    skiplist_reader_t  readers[SKIPLIST_MAX_THREADS];
+    skiplist_node_t   *limbo[3];  // Removed nodes, by epoch (mod 3).
+} skiplist_t;
+
+#define SKIPLIST_MARKED(p)   ((p) & 1)
+#define SKIPLIST_POINTER(p)  ((skiplist_node_t*) ((p) & ~(uintptr_t) 1))
+
+/*
+ * This thread's slot in readers, and its random number state for
+ * choosing tower heights.
+ */
+static __thread int skiplist_slot = -1;
+static __thread uint64_t skiplist_random = 0;
+
+static inline void *skiplist_data(skiplist_node_t *node) {
+    return (void*) &node->next[node->level];
+}
+
+static inline int skiplist_less(const skiplist_node_t *node,
+                                int64_t key, uint64_t sequence) {
+    return node->key < key
+        || (node->key == key && node->sequence < sequence);
+}
+
+static inline void skiplist_init(skiplist_t *list) {
+    memset(list, 0, sizeof(*list));
+    list->head = calloc(1, sizeof(skiplist_node_t)
+                        + SKIPLIST_MAX_LEVEL * sizeof(uintptr_t));
+    if (list->head == NULL)
+        errno_abort("Allocate skip list head");
+    list->head->key = INT64_MIN;
+    list->head->level = SKIPLIST_MAX_LEVEL;
+}
+
+/*
+ * Enter the list: announce the epoch this thread is reading in, so
+ * that nodes it may see are not freed under it.
+ */
+static inline void skiplist_enter(skiplist_t *list) {
+    skiplist_reader_t *reader;
+    uint64_t epoch;
+
+    if (skiplist_slot < 0) {
+        skiplist_slot = atomic_fetch_add(&list->readers_used, 1);
+        if (skiplist_slot >= SKIPLIST_MAX_THREADS)
+            err_abort(EAGAIN, "Too many skip list threads");
+    }
+    reader = &list->readers[skiplist_slot];
+
+    /*
+     * Re-read the global epoch after announcing, so the epoch we
+     * announce was current at a point where we were visibly active.
+     */
+    do {
+        epoch = atomic_load(&list->epoch);
+        atomic_store(&reader->epoch, epoch);
+        atomic_store(&reader->active, 1);
+    } while (atomic_load(&list->epoch) != epoch);
+}
+
+static inline void skiplist_exit(skiplist_t *list) {
+    atomic_store_explicit(&list->readers[skiplist_slot].active, 0,
+                          memory_order_release);
+}
+
+/*
+ * Find the predecessors and successors of the given key at every
+ * level, unlinking removed nodes on the way.
+ */
+static inline void skiplist_find(skiplist_t *list,
+                                 int64_t key, uint64_t sequence,
+                                 skiplist_node_t **preds,
+                                 skiplist_node_t **succs) {
+    skiplist_node_t *pred, *curr;
+    uintptr_t succ;
+    int level;
+
+retry:
+    pred = list->head;
+    for (level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--) {
+        curr = SKIPLIST_POINTER(atomic_load(&pred->next[level]));
+        while (curr != NULL) {
+            succ = atomic_load(&curr->next[level]);
+            while (SKIPLIST_MARKED(succ)) {
+                uintptr_t expected = (uintptr_t) curr;
+
+                if (!atomic_compare_exchange_strong(&pred->next[level],
+                                                    &expected,
+                                                    succ & ~(uintptr_t) 1))
+                    goto retry;
+                curr = SKIPLIST_POINTER(succ);
+                if (curr == NULL)
+                    break;
+                succ = atomic_load(&curr->next[level]);
+            }
+            if (curr == NULL || !skiplist_less(curr, key, sequence))
+                break;
+            pred = curr;
+            curr = SKIPLIST_POINTER(succ);
+        }
+        preds[level] = pred;
+        succs[level] = curr;
+    }
+}
+
+/*
+ * Make a node with a payload of the given size. Its tower height is
+ * random, with each level half as likely as the one below.
+ */
+static inline skiplist_node_t *skiplist_node_new(int64_t key, int32_t value,
+                                                 size_t payload) {
+    skiplist_node_t *node;
+    uint64_t x;
+    uint32_t level = 1;
+    size_t size;
+
+    if (skiplist_random == 0)
+        skiplist_random = (uintptr_t) &skiplist_random | 1;
+    x = skiplist_random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    skiplist_random = x;
+    x *= 0x2545F4914F6CDD1DULL;
+    while ((x & 1) && level < SKIPLIST_MAX_LEVEL) {
+        level++;
+        x >>= 1;
+    }
+
+    size = sizeof(skiplist_node_t) + level * sizeof(uintptr_t) + payload;
+    node = malloc(size);
+    if (node == NULL)
+        errno_abort("Allocate skip list node");
+    node->key = key;
+    node->value = value;
+    node->level = level;
+    node->size = size;
+    node->retired = NULL;
+    return node;
+}
+
+/*
+ * Insert a node (lock-free). Nodes with equal keys are kept in
+ * insertion order.
+ */
+static inline void skiplist_insert(skiplist_t *list, skiplist_node_t *node) {
+    skiplist_node_t *preds[SKIPLIST_MAX_LEVEL];
+    skiplist_node_t *succs[SKIPLIST_MAX_LEVEL];
+    uintptr_t expected;
+    uintptr_t next;
+    uint32_t level;
+
+    node->sequence = atomic_fetch_add(&list->sequence, 1);
+    atomic_fetch_add(&list->count, 1);
+    atomic_fetch_add(&list->bytes, node->size);
+
+    skiplist_enter(list);
+
+    // Link the bottom level, which is what makes the node present.
+    while (1) {
+        skiplist_find(list, node->key, node->sequence, preds, succs);
+        for (level = 0; level < node->level; level++)
+            atomic_init(&node->next[level], (uintptr_t) succs[level]);
+        expected = (uintptr_t) succs[0];
+        if (atomic_compare_exchange_strong(&preds[0]->next[0],
+                                           &expected, (uintptr_t) node))
+            break;
+    }
+
+    // Then the levels above, unless the node is removed meanwhile.
+    for (level = 1; level < node->level; level++) {
+        while (1) {
+            next = atomic_load(&node->next[level]);
+            if (SKIPLIST_MARKED(next))
+                goto done;
+            if (SKIPLIST_POINTER(next) != succs[level]
+                && !atomic_compare_exchange_strong(&node->next[level], &next,
+                                                   (uintptr_t) succs[level]))
+                continue;
+            expected = (uintptr_t) succs[level];
+            if (atomic_compare_exchange_strong(&preds[level]->next[level],
+                                               &expected, (uintptr_t) node))
+                break;
+            skiplist_find(list, node->key, node->sequence, preds, succs);
+        }
+    }
+
+done:
+    /*
+     * If the node was removed while we were linking it, a level we
+     * linked after the remover had looked may still point to it, so
+     * unlink it from every level before leaving.
+     */
+    if (SKIPLIST_MARKED(atomic_load(&node->next[0])))
+        skiplist_find(list, node->key, node->sequence, preds, succs);
+
+    skiplist_exit(list);
+}
+
+/*
+ * First node that has not been removed, or NULL. The caller must be
+ * inside the list (or be the only remover, which is the only one who
+ * frees nodes).
+ */
+static inline skiplist_node_t *skiplist_first(skiplist_t *list) {
+    skiplist_node_t *node;
+
+    node = SKIPLIST_POINTER(atomic_load(&list->head->next[0]));
+    while (node != NULL && SKIPLIST_MARKED(atomic_load(&node->next[0])))
+        node = SKIPLIST_POINTER(atomic_load(&node->next[0]));
+    return node;
+}
+
+/*
+ * Last node that has not been removed, or NULL (same caveat as
+ * skiplist_first).
+ */
+static inline skiplist_node_t *skiplist_last(skiplist_t *list) {
+    skiplist_node_t *pred = list->head;
+    skiplist_node_t *curr;
+    skiplist_node_t *last = NULL;
+    int level;
+
+    // Run along the top levels to get near the end quickly.
+    for (level = SKIPLIST_MAX_LEVEL - 1; level > 0; level--) {
+        while ((curr = SKIPLIST_POINTER(atomic_load(&pred->next[level])))
+               != NULL
+               && !SKIPLIST_MARKED(atomic_load(&curr->next[0])))
+            pred = curr;
+    }
+    for (curr = pred; curr != NULL;
+         curr = SKIPLIST_POINTER(atomic_load(&curr->next[0]))) {
+        if (curr != list->head && !SKIPLIST_MARKED(atomic_load(&curr->next[0])))
+            last = curr;
+    }
+    return last;
+}
+
+/*
+ * Hand a removed node over to be freed once no thread can still be
+ * looking at it, and free whatever has become safe to free.
+ */
+static inline void skiplist_retire(skiplist_t *list, skiplist_node_t *node) {
+    skiplist_node_t *free_list;
+    uint64_t epoch = atomic_load(&list->epoch);
+    int used = atomic_load(&list->readers_used);
+    int i;
+
+    node->retired = list->limbo[epoch % 3];
+    list->limbo[epoch % 3] = node;
+
+    // The epoch can only move on once every active thread is in it.
+    for (i = 0; i < used && i < SKIPLIST_MAX_THREADS; i++) {
+        if (atomic_load(&list->readers[i].active)
+            && atomic_load(&list->readers[i].epoch) != epoch)
+            return;
+    }
+
+    /*
+     * Nobody can still be looking at nodes removed two epochs ago
+     * (the bucket that the new epoch is about to reuse).
+     */
+    free_list = list->limbo[(epoch + 1) % 3];
+    list->limbo[(epoch + 1) % 3] = NULL;
+    atomic_store(&list->epoch, epoch + 1);
+    while (free_list != NULL) {
+        node = free_list;
+        free_list = node->retired;
+        free(node);
+    }
+}
+
+/*
+ * Remove a node. Callers must serialize removals among themselves.
+ * The node is freed later; it may be used until the caller next
+ * removes a node.
+ */
+static inline void skiplist_remove(skiplist_t *list, skiplist_node_t *node) {
+    skiplist_node_t *preds[SKIPLIST_MAX_LEVEL];
+    skiplist_node_t *succs[SKIPLIST_MAX_LEVEL];
+    uintptr_t next;
+    int level;
+
+    skiplist_enter(list);
+
+    // Mark every level, top down; marking the bottom one removes it.
+    for (level = node->level - 1; level >= 0; level--) {
+        next = atomic_load(&node->next[level]);
+        while (!SKIPLIST_MARKED(next)
+               && !atomic_compare_exchange_weak(&node->next[level], &next,
+                                                next | 1))
+            ;
+    }
+
+    // Unlink it from every level.
+    skiplist_find(list, node->key, node->sequence, preds, succs);
+
+    skiplist_exit(list);
+
+    atomic_fetch_sub(&list->count, 1);
+    atomic_fetch_sub(&list->bytes, node->size);
+    skiplist_retire(list, node);
+}
+
+/*
+ * Call visit for every node with from <= key <= to, in order,
+ * without taking any lock. Stops early if visit returns nonzero.
+ */
+static inline void skiplist_range(skiplist_t *list, int64_t from, int64_t to,
+                                  int (*visit)(skiplist_node_t *, void *),
+                                  void *arg) {
+    skiplist_node_t *pred = list->head;
+    skiplist_node_t *curr;
+    int level;
+
+    skiplist_enter(list);
+
+    for (level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--) {
+        while ((curr = SKIPLIST_POINTER(atomic_load(&pred->next[level])))
+               != NULL
+               && curr->key < from)
+            pred = curr;
+    }
+
+    for (curr = SKIPLIST_POINTER(atomic_load(&pred->next[0]));
+         curr != NULL && curr->key <= to;
+         curr = SKIPLIST_POINTER(atomic_load(&curr->next[0]))) {
+        if (!SKIPLIST_MARKED(atomic_load(&curr->next[0]))
+            && visit(curr, arg))
+            break;
+    }
+
+    skiplist_exit(list);
+}
+
+#endif